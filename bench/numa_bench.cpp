@@ -0,0 +1,87 @@
+// how often the runs of a task move between NUMA nodes, with the pool's single injection queue and with per_node
+// placement: a feeder thread posts each run of a task to the node task id % nodes like the scheduler does, and a run
+// on another node than the one before it counts as cross-node. once with a few functors in flight, once in bursts.
+// numa_bench [workers [sysfs node dir]], 4 and /sys/devices/system/node by default.
+// on a machine with one node its cpus are split into two pretend nodes, that measures where the runs go but not
+// what it costs to move them
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+#include "tread_pool.hpp"
+
+using namespace std::chrono;
+
+namespace
+{
+    constexpr int tasks = 64;
+    constexpr int rounds = 2000;
+
+    void run(int workers, const std::vector<std::vector<int>> &nodes, bool per_node, int window)
+    {
+        tp::placement where;
+        where.per_node = per_node;
+        where.nodes = nodes;
+        tp::thread_pool pool(workers, where);
+        // workers go round robin over the nodes, with per_node placement they are pinned there
+        auto n_nodes = static_cast<int>(nodes.size());
+        std::vector<int> last(tasks, -1);
+        std::vector<long> moves(tasks, 0);
+        std::atomic<int> in_flight{0};
+        auto start = steady_clock::now();
+        for (int r = 0; r < rounds; ++r)
+        {
+            for (int t = 0; t < tasks; ++t)
+            {
+                while (in_flight >= window)
+                    std::this_thread::yield();
+                ++in_flight;
+                tp::urgency u;
+                u.node = per_node ? t % n_nodes : -1;
+                pool.post([&, t, n_nodes](int id)
+                          {
+                              int node = id % n_nodes;
+                              if (last[t] >= 0 && last[t] != node)
+                                  ++moves[t];
+                              last[t] = node;
+                              // a callback that does a little work
+                              volatile int x = 0;
+                              for (int i = 0; i < 200; ++i)
+                                  x += i;
+                              --in_flight;
+                          }, u);
+            }
+            while (in_flight > 0)
+                std::this_thread::yield();
+        }
+        auto ms = duration<double, std::milli>(steady_clock::now() - start).count();
+        long moved = 0;
+        for (auto m : moves)
+            moved += m;
+        std::printf("%2d in flight, %-12s cross-node %5.1f%% of %d runs, %7.1f ms\n", window,
+                    per_node ? "per_node" : "shared queue", 100.0 * static_cast<double>(moved) / (tasks * rounds),
+                    tasks * rounds, ms);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int workers = argc > 1 ? std::atoi(argv[1]) : 4;
+    auto nodes = argc > 2 ? tp::numa_nodes(argv[2]) : tp::numa_nodes();
+    if (nodes.size() == 1)
+    {
+        auto cpus = nodes[0];
+        std::size_t half = (cpus.size() + 1) / 2;
+        nodes = {std::vector<int>(cpus.begin(), cpus.begin() + static_cast<std::ptrdiff_t>(half)),
+                 std::vector<int>(cpus.begin() + static_cast<std::ptrdiff_t>(cpus.size() - half), cpus.end())};
+        std::printf("one NUMA node, its %zu cpus split into two pretend nodes\n", cpus.size());
+    }
+    std::printf("%d workers over %zu nodes, %d tasks\n", workers, nodes.size(), tasks);
+    for (int window : {4, 64})
+        for (bool per_node : {false, true})
+            run(workers, nodes, per_node, window);
+    return 0;
+}
@@ -0,0 +1,158 @@
+// contention in tp::thread_pool against the pool it replaced, one queue under a mutex with a notify on every push:
+// producers outside the pool push functors while a seventh of those push two more from inside it.
+// pool_bench [workers [producers [functors per producer]]], 8, 4 and 50000 by default
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+#include "tread_pool.hpp"
+
+using namespace std::chrono;
+
+namespace
+{
+    // the old pool cut down to a fixed size: every push allocates the wrapper and locks the queue and the wakeup mutex
+    class LockedPool
+    {
+    public:
+        explicit LockedPool(int nThreads) : isDone(false)
+        {
+            for (int i = 0; i < nThreads; ++i)
+                this->threads.emplace_back([this, i]() { this->work(i); });
+        }
+
+        // runs what is queued before returning
+        ~LockedPool()
+        {
+            {
+                std::unique_lock<std::mutex> lock(this->mutex);
+                this->isDone = true;
+                this->cv.notify_all();
+            }
+            for (auto &t : this->threads)
+                t.join();
+        }
+
+        template<typename F>
+        auto push(F && f) -> std::future<decltype(f(0))>
+        {
+            auto pck = std::make_shared<std::packaged_task<decltype(f(0))(int)>>(std::forward<F>(f));
+            auto _f = new std::function<void(int id)>([pck](int id) { (*pck)(id); });
+            {
+                std::unique_lock<std::mutex> lock(this->queue_mutex);
+                this->q.push(_f);
+            }
+            std::unique_lock<std::mutex> lock(this->mutex);
+            this->cv.notify_one();
+            return pck->get_future();
+        }
+
+    private:
+        std::vector<std::thread> threads;
+        std::queue<std::function<void(int id)> *> q;
+        std::mutex queue_mutex;
+        bool isDone;
+        std::mutex mutex;
+        std::condition_variable cv;
+
+        bool pop(std::function<void(int id)> * & f)
+        {
+            std::unique_lock<std::mutex> lock(this->queue_mutex);
+            if (this->q.empty())
+                return false;
+            f = this->q.front();
+            this->q.pop();
+            return true;
+        }
+
+        void work(int i)
+        {
+            std::function<void(int id)> * f;
+            while (true)
+            {
+                while (this->pop(f))
+                {
+                    std::unique_ptr<std::function<void(int id)>> func(f);
+                    (*f)(i);
+                }
+                std::unique_lock<std::mutex> lock(this->mutex);
+                bool isPop = false;
+                this->cv.wait(lock, [this, &f, &isPop]() { isPop = this->pop(f); return isPop || this->isDone; });
+                if (!isPop)
+                    return;
+                lock.unlock();
+                std::unique_ptr<std::function<void(int id)>> func(f);
+                (*f)(i);
+            }
+        }
+    };
+
+    int workers = 8;
+    int producers = 4;
+    int per_producer = 50000;
+
+    // ms until every functor ran, the pool is made and destroyed inside the timing
+    template<typename Pool, typename Submit>
+    double round(Submit submit)
+    {
+        std::atomic<long> n{0};
+        long expected = static_cast<long>(producers) * (per_producer + 2 * ((per_producer + 6) / 7));
+        auto start = steady_clock::now();
+        {
+            Pool pool(workers);
+            std::vector<std::thread> threads;
+            for (int p = 0; p < producers; ++p)
+                threads.emplace_back([&]()
+                {
+                    for (int i = 0; i < per_producer; ++i)
+                        submit(pool, [&pool, &n, &submit, i](int)
+                        {
+                            n.fetch_add(1, std::memory_order_relaxed);
+                            if (i % 7 == 0)
+                                for (int k = 0; k < 2; ++k)
+                                    submit(pool, [&n](int) { n.fetch_add(1, std::memory_order_relaxed); });
+                        });
+                });
+            for (auto &t : threads)
+                t.join();
+            while (n < expected)
+                std::this_thread::yield();
+        }
+        return duration<double, std::milli>(steady_clock::now() - start).count();
+    }
+
+    template<typename Pool, typename Submit>
+    void run(const char *name, Submit submit)
+    {
+        std::vector<double> times;
+        for (int i = 0; i < 7; ++i)
+            times.push_back(round<Pool>(submit));
+        std::sort(times.begin(), times.end());
+        std::printf("%-22s median %8.1f ms, min %8.1f ms, max %8.1f ms\n", name, times[times.size() / 2], times.front(), times.back());
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1)
+        workers = std::atoi(argv[1]);
+    if (argc > 2)
+        producers = std::atoi(argv[2]);
+    if (argc > 3)
+        per_producer = std::atoi(argv[3]);
+    std::printf("%d workers, %d producers, %d functors each\n", workers, producers, per_producer);
+
+    run<LockedPool>("locked queue, push", [](LockedPool &pool, auto &&f) { pool.push(std::forward<decltype(f)>(f)); });
+    run<tp::thread_pool>("work stealing, push", [](tp::thread_pool &pool, auto &&f) { pool.push(std::forward<decltype(f)>(f)); });
+    run<tp::thread_pool>("work stealing, post", [](tp::thread_pool &pool, auto &&f) { pool.post(std::forward<decltype(f)>(f)); });
+    return 0;
+}
@@ -0,0 +1,60 @@
+// secman::ProcessRunner against the system() it replaced, for a command it spawns directly and for one that needs
+// the shell, from 1 and 4 threads, and once more from a parent with a large resident set that fork would have to copy.
+// spawn_bench [runs [resident MB]], 2000 and 512 by default
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+#include <sys/wait.h>
+#include "process_runner.hpp"
+
+using namespace std::chrono;
+
+namespace
+{
+    // ms for runs calls of run split over the threads
+    template<typename Run>
+    double time_runs(int threads, int runs, Run run)
+    {
+        auto start = steady_clock::now();
+        std::vector<std::thread> all;
+        for (int t = 0; t < threads; ++t)
+            all.emplace_back([&]()
+            {
+                for (int i = 0; i < runs / threads; ++i)
+                    if (!WIFEXITED(run()))
+                        std::abort();
+            });
+        for (auto &t : all)
+            t.join();
+        return duration<double, std::milli>(steady_clock::now() - start).count();
+    }
+
+    void compare(const char *command, int threads, int runs)
+    {
+        secman::ProcessRunner runner(command);
+        auto spawned = time_runs(threads, runs, [&runner]() { return runner(); });
+        auto system = time_runs(threads, runs, [command]() { return std::system(command); });
+        std::printf("%-22s %s, %d thread%s, %5d runs: spawn %8.1f ms, system() %8.1f ms\n", command,
+                    runner.uses_shell() ? "shell " : "direct", threads, threads == 1 ? " " : "s", runs, spawned, system);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int runs = argc > 1 ? std::atoi(argv[1]) : 2000;
+    std::size_t resident_mb = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 512;
+
+    for (auto command : {"true", "true > /dev/null"})
+        for (int threads : {1, 4})
+            compare(command, threads, runs);
+
+    // touched, so the pages are really there
+    std::vector<char> resident(resident_mb << 20);
+    std::memset(resident.data(), 1, resident.size());
+    std::printf("with %zu MB resident:\n", resident_mb);
+    compare("true", 1, runs / 4);
+    return resident[resident.size() / 2] == 1 ? 0 : 1;
+}
@@ -0,0 +1,80 @@
+// the timing wheel against the multimap it replaced: inserting timers due within 10 minutes, re-arming them like
+// interval tasks as they expire, and draining the queue one wakeup at a time.
+// timer_queue_bench [N...], 10k, 100k and 1M timers by default
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <vector>
+#include "timer_queue.hpp"
+
+using namespace std::chrono;
+
+namespace
+{
+    double ms_since(steady_clock::time_point start)
+    {
+        return duration<double, std::milli>(steady_clock::now() - start).count();
+    }
+
+    template<typename Queue>
+    void run(const char *name, std::size_t n)
+    {
+        // the queues never look into a task, a null one sharing the count of an int costs the same to copy
+        std::vector<std::shared_ptr<secman::Task>> tasks;
+        tasks.reserve(n);
+        for (std::size_t i = 0; i < n; ++i)
+            tasks.emplace_back(std::make_shared<int>(), nullptr);
+        std::mt19937_64 rng(1);
+        auto base = time_point_cast<milliseconds>(system_clock::now());
+        Queue q;
+        std::vector<secman::TimerQueue::entry> expired;
+
+        auto start = steady_clock::now();
+        for (auto &t : tasks)
+            q.insert(base + milliseconds(1 + rng() % 600000), t);
+        auto insert = ms_since(start);
+
+        // a minute of 1 ms ticks, what expires comes back 10 minutes later
+        start = steady_clock::now();
+        std::size_t rearmed = 0;
+        for (auto now = base; now < base + minutes(1); now += milliseconds(1))
+        {
+            q.pop_expired(now, expired);
+            for (auto &e : expired)
+                q.insert(e.first + minutes(10), std::move(e.second));
+            rearmed += expired.size();
+            expired.clear();
+        }
+        auto rearm = ms_since(start);
+
+        start = steady_clock::now();
+        std::size_t drained = 0;
+        while (!q.empty())
+        {
+            q.pop_expired(q.next_expiry(), expired);
+            drained += expired.size();
+            expired.clear();
+        }
+        auto drain = ms_since(start);
+
+        std::printf("%-8s %8zu timers: insert %9.2f ms, rearm %9.2f ms (%zu), drain %9.2f ms (%zu)\n",
+                    name, n, insert, rearm, rearmed, drain, drained);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    std::vector<std::size_t> sizes;
+    for (int i = 1; i < argc; ++i)
+        sizes.push_back(std::strtoull(argv[i], nullptr, 10));
+    if (sizes.empty())
+        sizes = {10000, 100000, 1000000};
+    for (auto n : sizes)
+    {
+        run<secman::MultimapTimerQueue>("multimap", n);
+        run<secman::TimingWheel>("wheel", n);
+    }
+    return 0;
+}
@@ -0,0 +1,456 @@
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "control.hpp"
+
+namespace
+{
+    // anything bigger is not a frame of ours
+    constexpr std::uint32_t max_frame = 64 << 20;
+
+    [[noreturn]] void throw_errno(const std::string &what)
+    {
+        throw std::system_error(errno, std::generic_category(), what);
+    }
+
+    template<typename T>
+    void put(std::string &out, T value)
+    {
+        out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+    }
+
+    void put(std::string &out, const std::string &value)
+    {
+        put(out, static_cast<std::uint32_t>(value.size()));
+        out += value;
+    }
+
+    class Reader
+    {
+    public:
+        Reader(const char *data, std::size_t size) : p(data), end(data + size) {}
+
+        template<typename T>
+        T get()
+        {
+            need(sizeof(T));
+            T value;
+            std::memcpy(&value, p, sizeof(T));
+            p += sizeof(T);
+            return value;
+        }
+
+        std::string get_string()
+        {
+            auto size = get<std::uint32_t>();
+            need(size);
+            std::string value(p, size);
+            p += size;
+            return value;
+        }
+
+    private:
+        const char *p;
+        const char *end;
+
+        void need(std::size_t size)
+        {
+            if (static_cast<std::size_t>(end - p) < size)
+                throw std::runtime_error("truncated control message");
+        }
+    };
+
+    // a frame is written with a placeholder length that is filled in once the body is there
+    std::size_t begin_frame(std::string &out)
+    {
+        put(out, std::uint32_t(0));
+        return out.size();
+    }
+
+    void end_frame(std::string &out, std::size_t body)
+    {
+        auto size = static_cast<std::uint32_t>(out.size() - body);
+        std::memcpy(&out[body - sizeof(size)], &size, sizeof(size));
+    }
+
+    void encode(std::string &out, const secman::ControlRequest &request)
+    {
+        using Type = secman::ControlRequest::Type;
+        auto body = begin_frame(out);
+        put(out, request.type);
+        switch (request.type)
+        {
+            case Type::add_at:
+                put(out, request.time);
+                put(out, request.command);
+                put(out, request.overlap);
+                put(out, request.group);
+                put(out, request.jitter);
+                put(out, request.priority);
+                break;
+            case Type::add_cron:
+                put(out, request.expression);
+                put(out, request.command);
+                put(out, request.overlap);
+                put(out, request.group);
+                put(out, request.jitter);
+                put(out, request.priority);
+                break;
+            case Type::list:
+            case Type::remove:
+                put(out, request.id);
+                break;
+            case Type::stats:
+                break;
+            case Type::load:
+                put(out, request.path);
+                put(out, request.text);
+                break;
+        }
+        end_frame(out, body);
+    }
+
+    secman::ControlRequest decode_request(Reader &in)
+    {
+        using Type = secman::ControlRequest::Type;
+        secman::ControlRequest request{in.get<Type>()};
+        switch (request.type)
+        {
+            case Type::add_at:
+                request.time = in.get<std::int64_t>();
+                request.command = in.get_string();
+                request.overlap = in.get<std::uint8_t>();
+                request.group = in.get_string();
+                request.jitter = in.get<std::uint32_t>();
+                request.priority = in.get<std::int32_t>();
+                break;
+            case Type::add_cron:
+                request.expression = in.get_string();
+                request.command = in.get_string();
+                request.overlap = in.get<std::uint8_t>();
+                request.group = in.get_string();
+                request.jitter = in.get<std::uint32_t>();
+                request.priority = in.get<std::int32_t>();
+                break;
+            case Type::list:
+            case Type::remove:
+                request.id = in.get<std::uint64_t>();
+                break;
+            case Type::stats:
+                break;
+            case Type::load:
+                request.path = in.get_string();
+                request.text = in.get_string();
+                break;
+            default:
+                throw std::runtime_error("unknown control request");
+        }
+        return request;
+    }
+
+    void encode(std::string &out, const secman::ControlResponse &response)
+    {
+        using Type = secman::ControlResponse::Type;
+        auto body = begin_frame(out);
+        put(out, response.type);
+        switch (response.type)
+        {
+            case Type::id:
+                put(out, response.id);
+                break;
+            case Type::ok:
+                break;
+            case Type::error:
+                put(out, response.error);
+                break;
+            case Type::list:
+                put(out, static_cast<std::uint32_t>(response.entries.size()));
+                for (auto &entry : response.entries)
+                {
+                    put(out, entry.id);
+                    put(out, static_cast<std::uint8_t>(entry.running));
+                    put(out, entry.next);
+                    put(out, static_cast<std::uint8_t>(entry.recur));
+                    put(out, entry.command);
+                }
+                break;
+            case Type::stats:
+                put(out, response.error);
+                put(out, static_cast<std::uint32_t>(response.stats.size()));
+                for (auto &stat : response.stats)
+                {
+                    put(out, stat.first);
+                    put(out, stat.second);
+                }
+                break;
+        }
+        end_frame(out, body);
+    }
+
+    secman::ControlResponse decode_response(Reader &in)
+    {
+        using Type = secman::ControlResponse::Type;
+        secman::ControlResponse response{in.get<Type>()};
+        switch (response.type)
+        {
+            case Type::id:
+                response.id = in.get<std::uint64_t>();
+                break;
+            case Type::ok:
+                break;
+            case Type::error:
+                response.error = in.get_string();
+                break;
+            case Type::list:
+                for (auto n = in.get<std::uint32_t>(); n > 0; --n)
+                {
+                    secman::ControlResponse::Entry entry{};
+                    entry.id = in.get<std::uint64_t>();
+                    entry.running = in.get<std::uint8_t>() != 0;
+                    entry.next = in.get<std::int64_t>();
+                    entry.recur = in.get<std::uint8_t>() != 0;
+                    entry.command = in.get_string();
+                    response.entries.push_back(std::move(entry));
+                }
+                break;
+            case Type::stats:
+                response.error = in.get_string();
+                for (auto n = in.get<std::uint32_t>(); n > 0; --n)
+                {
+                    auto name = in.get_string();
+                    response.stats.emplace_back(std::move(name), in.get<std::uint64_t>());
+                }
+                break;
+            default:
+                throw std::runtime_error("unknown control response");
+        }
+        return response;
+    }
+
+    // calls f on each complete frame at the start of buffer and removes them
+    // returns false on a frame that is too big to be ours
+    template<typename F>
+    bool take_frames(std::string &buffer, F &&f)
+    {
+        std::size_t offset = 0;
+        while (buffer.size() - offset >= sizeof(std::uint32_t))
+        {
+            std::uint32_t size;
+            std::memcpy(&size, buffer.data() + offset, sizeof(size));
+            if (size > max_frame)
+                return false;
+            if (buffer.size() - offset - sizeof(size) < size)
+                break;
+            Reader in(buffer.data() + offset + sizeof(size), size);
+            f(in);
+            offset += sizeof(size) + size;
+        }
+        buffer.erase(0, offset);
+        return true;
+    }
+
+    sockaddr_un address_of(const std::string &socket_path)
+    {
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        if (socket_path.size() >= sizeof(address.sun_path))
+            throw std::runtime_error("socket path too long: " + socket_path);
+        std::memcpy(address.sun_path, socket_path.c_str(), socket_path.size() + 1);
+        return address;
+    }
+}
+
+std::string secman::default_socket_path()
+{
+    if (const char *runtime_dir = std::getenv("XDG_RUNTIME_DIR"))
+        return std::string(runtime_dir) + "/secman.sock";
+    return "/tmp/secman-" + std::to_string(getuid()) + ".sock";
+}
+
+secman::ControlServer::ControlServer(std::string socket_path, handler handle)
+        : socket_path(std::move(socket_path)), handle(std::move(handle)), done(false)
+{
+    auto address = address_of(this->socket_path);
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd == -1)
+        throw_errno("socket");
+    unlink(this->socket_path.c_str());
+    // whoever can connect can run commands as us, so only we may. the owner is checked again on accept,
+    // a client may have connected before the chmod
+    if (bind(listen_fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) == -1
+        || chmod(this->socket_path.c_str(), S_IRUSR | S_IWUSR) == -1
+        || listen(listen_fd, SOMAXCONN) == -1)
+    {
+        auto error = errno;
+        close(listen_fd);
+        throw std::system_error(error, std::generic_category(), "bind " + this->socket_path);
+    }
+    loop.watch(listen_fd, [this]() { accept_client(); });
+    thread = std::thread([this]()
+                         {
+                             while (!done)
+                                 loop.sleep();
+                         });
+}
+
+secman::ControlServer::~ControlServer()
+{
+    done = true;
+    loop.interrupt();
+    thread.join();
+    for (auto &connection : connections)
+    {
+        loop.unwatch(connection.first);
+        close(connection.first);
+    }
+    loop.unwatch(listen_fd);
+    close(listen_fd);
+    unlink(socket_path.c_str());
+}
+
+void secman::ControlServer::accept_client()
+{
+    int fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+    if (fd == -1)
+        return;
+    ucred peer{};
+    socklen_t length = sizeof(peer);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &length) == -1 || peer.uid != geteuid())
+    {
+        close(fd);
+        return;
+    }
+    // responses are written blocking, a client that stops reading is dropped instead of stalling everyone
+    timeval timeout{5, 0};
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    connections.emplace(fd, std::string());
+    loop.watch(fd, [this, fd]() { serve(fd); });
+}
+
+void secman::ControlServer::serve(int fd)
+{
+    auto connection = connections.find(fd);
+    if (connection == connections.end())
+        return;
+    auto &buffer = connection->second;
+
+    // one read per wake up, epoll reports the socket again while there is more, and the other clients get their turn
+    char chunk[64 * 1024];
+    ssize_t n = recv(fd, chunk, sizeof(chunk), MSG_DONTWAIT);
+    bool hung_up = n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR);
+    if (n > 0)
+        buffer.append(chunk, static_cast<std::size_t>(n));
+
+    std::string out;
+    bool valid = take_frames(buffer, [this, &out](Reader &in)
+    {
+        ControlResponse response;
+        try
+        {
+            response = handle(decode_request(in));
+        }
+        catch (std::exception &e)
+        {
+            response = ControlResponse{ControlResponse::Type::error};
+            response.error = e.what();
+        }
+        encode(out, response);
+    });
+
+    for (std::size_t sent = 0; sent < out.size();)
+    {
+        ssize_t n = send(fd, out.data() + sent, out.size() - sent, MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            hung_up = true;
+            break;
+        }
+        sent += static_cast<std::size_t>(n);
+    }
+
+    if (hung_up || !valid)
+        drop(fd);
+}
+
+void secman::ControlServer::drop(int fd)
+{
+    loop.unwatch(fd);
+    close(fd);
+    connections.erase(fd);
+}
+
+secman::ControlClient::ControlClient(const std::string &socket_path)
+{
+    auto address = address_of(socket_path);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        throw_errno("socket");
+    if (connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) == -1)
+    {
+        auto error = errno;
+        close(fd);
+        throw std::system_error(error, std::generic_category(), "no secman daemon on " + socket_path);
+    }
+}
+
+secman::ControlClient::~ControlClient()
+{
+    close(fd);
+}
+
+std::vector<secman::ControlResponse> secman::ControlClient::call(const std::vector<ControlRequest> &requests)
+{
+    std::string out;
+    for (auto &request : requests)
+        encode(out, request);
+
+    // reads while it writes, the daemon starts answering before a big batch is fully sent
+    std::vector<ControlResponse> responses;
+    responses.reserve(requests.size());
+    std::string in;
+    char chunk[64 * 1024];
+    std::size_t sent = 0;
+    while (responses.size() < requests.size())
+    {
+        pollfd p{fd, static_cast<short>(POLLIN | (sent < out.size() ? POLLOUT : 0)), 0};
+        if (poll(&p, 1, -1) == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            throw_errno("poll");
+        }
+        if (p.revents & POLLOUT)
+        {
+            ssize_t n = send(fd, out.data() + sent, out.size() - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (n > 0)
+                sent += static_cast<std::size_t>(n);
+            else if (n == -1 && errno != EAGAIN && errno != EINTR)
+                throw_errno("send");
+        }
+        if (p.revents & (POLLIN | POLLHUP | POLLERR))
+        {
+            ssize_t n = recv(fd, chunk, sizeof(chunk), MSG_DONTWAIT);
+            if (n == 0)
+                throw std::runtime_error("the secman daemon closed the connection");
+            if (n == -1)
+            {
+                if (errno == EAGAIN || errno == EINTR)
+                    continue;
+                throw_errno("recv");
+            }
+            in.append(chunk, static_cast<std::size_t>(n));
+            if (!take_frames(in, [&responses](Reader &frame) { responses.push_back(decode_response(frame)); }))
+                throw std::runtime_error("malformed response from the secman daemon");
+        }
+    }
+    return responses;
+}
@@ -0,0 +1,112 @@
+#ifndef SECMAN_CONTROL_H
+#define SECMAN_CONTROL_H
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "interruptable_sleep.hpp"
+
+namespace secman
+{
+    // control protocol between the secman daemon and its clients over a unix stream socket.
+    // every message is a frame: a 32 bit length, then the body, which starts with the type byte.
+    // integers are in host byte order, strings are a 32 bit length and the bytes.
+    // a client may send any number of requests before reading, the responses come back in the same order.
+
+    struct ControlRequest
+    {
+        enum class Type : std::uint8_t { add_at = 1, add_cron, list, remove, stats, load };
+
+        Type type;
+        std::uint64_t id = 0;    // list (0 for all of them), remove
+        std::int64_t time = 0;   // add_at, system_clock ticks since the epoch
+        std::string expression{};  // add_cron
+        std::string command{};     // add_at, add_cron
+        std::uint8_t overlap = 0;  // add_at, add_cron: the scheduler's Overlap
+        std::string group{};       // add_at, add_cron: the concurrency group, none if empty
+        std::uint32_t jitter = 0;  // add_at, add_cron: milliseconds
+        std::int32_t priority = 0; // add_at, add_cron
+        std::string path{};      // load, a crontab file the daemon reads
+        std::string text{};      // load, the crontab itself when there is no path
+    };
+
+    struct ControlResponse
+    {
+        enum class Type : std::uint8_t { id = 1, ok, error, list, stats };
+
+        struct Entry
+        {
+            std::uint64_t id;
+            bool running;       // next is not known while an interval task runs
+            std::int64_t next;  // system_clock ticks since the epoch
+            bool recur;
+            std::string command;
+        };
+
+        Type type;
+        std::uint64_t id = 0;  // id
+        std::string error{};   // error, and the rejected lines of a load
+        std::vector<Entry> entries{};  // list
+        std::vector<std::pair<std::string, std::uint64_t>> stats{};  // stats and load, by name
+    };
+
+    // $XDG_RUNTIME_DIR/secman.sock, or /tmp/secman-<uid>.sock without it
+    std::string default_socket_path();
+
+    // accepts clients on its own thread and answers their requests with handle, one at a time.
+    // the socket is only open to our own user, clients of other users are hung up on
+    class ControlServer
+    {
+    public:
+        using handler = std::function<ControlResponse(const ControlRequest &)>;
+
+        // replaces a socket file left behind at socket_path
+        ControlServer(std::string socket_path, handler handle);
+        ControlServer(const ControlServer &) = delete;
+        ControlServer& operator=(const ControlServer &) = delete;
+        // closes all connections and removes the socket file
+        ~ControlServer();
+
+    private:
+        std::string socket_path;
+        handler handle;
+
+        int listen_fd;
+        // unanswered bytes of each client, only used on the server thread
+        std::unordered_map<int, std::string> connections;
+
+        std::atomic<bool> done;
+        InterruptableSleep loop;
+        std::thread thread;
+
+        void accept_client();
+        // reads what the client sent, answers every complete request and drops the client once it hangs up
+        void serve(int fd);
+        void drop(int fd);
+    };
+
+    // a connection to the daemon
+    class ControlClient
+    {
+    public:
+        // throws std::system_error if no daemon listens on socket_path
+        explicit ControlClient(const std::string &socket_path);
+        ControlClient(const ControlClient &) = delete;
+        ControlClient& operator=(const ControlClient &) = delete;
+        ~ControlClient();
+
+        // sends all requests at once, then reads their responses
+        std::vector<ControlResponse> call(const std::vector<ControlRequest> &requests);
+
+    private:
+        int fd;
+    };
+}
+
+#endif
@@ -1,99 +1,268 @@
+#include <algorithm>
+#include <stdexcept>
+#include <string_view>
 #include "cron.hpp"
 
-
-void secman::add(std::tm &tm, std::chrono::system_clock::duration time)
+namespace
 {
-    auto tp = std::chrono::system_clock::from_time_t(std::mktime(&tm));
-    auto tp_adjusted = tp + time;
-    auto tm_adjusted = std::chrono::system_clock::to_time_t(tp_adjusted);
-    tm = *std::localtime(&tm_adjusted);
-}
+    // a matching date is never further away than this, leap days are at most 8 years apart
+    constexpr int max_years = 28;
 
-void secman::verify_and_set(const std::string &token, const std::string &expression, int &field, const int lower_bound,
-                            const int upper_bound, const bool adjust)
-{
-    if (token == "*" | token == "* ")
-        field = -1;
-    else
+    [[noreturn]] void malformed(std::string_view expression)
+    {
+        throw std::runtime_error("malformed cron string: " + std::string(expression));
+    }
+
+    [[noreturn]] void out_of_range(std::string_view expression)
+    {
+        throw std::runtime_error("cron out of range: " + std::string(expression));
+    }
+
+    // decimal digits only
+    int to_number(std::string_view token, std::string_view expression)
+    {
+        if (token.empty() || token.size() > 4) malformed(expression);
+        int value = 0;
+        for (char c : token)
+        {
+            if (c < '0' || c > '9') malformed(expression);
+            value = value * 10 + (c - '0');
+        }
+        return value;
+    }
+
+    // parses one field into a mask, bit (value - offset) is set for every accepted value
+    // works on views into the expression, nothing is allocated unless it is malformed
+    std::uint64_t parse_field(std::string_view field, std::string_view expression,
+                              const int lower_bound, const int upper_bound, const int offset = 0)
+    {
+        std::uint64_t mask = 0;
+        while (true)
+        {
+            auto comma = field.find(',');
+            auto item = field.substr(0, comma);
+
+            int step = 1;
+            auto slash = item.find('/');
+            if (slash != std::string_view::npos)
+            {
+                step = to_number(item.substr(slash + 1), expression);
+                if (step < 1) out_of_range(expression);
+                item = item.substr(0, slash);
+            }
+
+            int first, last;
+            if (item == "*")
+            {
+                first = lower_bound;
+                last = upper_bound;
+            }
+            else
+            {
+                auto dash = item.find('-');
+                first = to_number(item.substr(0, dash), expression);
+                if (dash != std::string_view::npos)
+                    last = to_number(item.substr(dash + 1), expression);
+                else
+                    last = slash != std::string_view::npos ? upper_bound : first;
+            }
+
+            if (first < lower_bound || last > upper_bound || first > last)
+                out_of_range(expression);
+
+            for (int value = first; value <= last; value += step)
+                mask |= std::uint64_t(1) << (value - offset);
+
+            if (comma == std::string_view::npos)
+                break;
+            field.remove_prefix(comma + 1);
+        }
+        if (mask == 0) malformed(expression);
+        return mask;
+    }
+
+    int count_trailing_zeros(std::uint64_t x)
+    {
+        return __builtin_ctzll(x);
+    }
+
+    bool is_leap(int year)
+    {
+        return (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
+    }
+
+    int days_in_month(int year, int month)
+    {
+        static const int days[] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+        return month == 1 && is_leap(year) ? 29 : days[month];
+    }
+
+    // 0 is Sunday, month is 0 - 11
+    // http://howardhinnant.github.io/date_algorithms.html#days_from_civil
+    int weekday(int year, int month, int day)
     {
-        field = std::stoi(token);
-        if (field < lower_bound || field > upper_bound) throw std::runtime_error("cron out of range: " + expression);
-        if (adjust)
-            field--;
+        int m = month + 1;
+        year -= m <= 2;
+        const int era = (year >= 0 ? year : year - 399) / 400;
+        const int yoe = year - era * 400;
+        const int doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+        const int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+        const long days = era * 146097L + doe - 719468;
+        return static_cast<int>(days >= -4 ? (days + 4) % 7 : (days + 5) % 7 + 6);
     }
 }
 
-secman::Cron::Cron(const std::string &expression)
+secman::Cron::Cron()
+        : minutes(0), hours(0), days(0), months(0), days_of_week(0), any_day(true), any_day_of_week(true) {}
+
+secman::Cron::Cron(std::string_view expression)
 {
-    std::istringstream iss(expression);
-    std::vector<std::string> tokens{std::istream_iterator<std::string>{iss},
-                                    std::istream_iterator<std::string>{}};
+    // split on blanks into exactly five fields
+    std::string_view rest(expression);
+    std::string_view tokens[5];
+    int n = 0;
+    while (true)
+    {
+        auto begin = rest.find_first_not_of(" \t\n");
+        if (begin == std::string_view::npos)
+            break;
+        rest.remove_prefix(begin);
+        if (n == 5) malformed(expression);
+        auto end = std::min(rest.find_first_of(" \t\n"), rest.size());
+        tokens[n++] = rest.substr(0, end);
+        rest.remove_prefix(end);
+    }
+
+    if (n != 5) malformed(expression);
 
-    if (tokens.size() != 5) throw std::runtime_error("malformed cron string: " + expression);
+    minutes = parse_field(tokens[0], expression, 0, 59);
+    hours = static_cast<std::uint32_t>(parse_field(tokens[1], expression, 0, 23));
+    days = static_cast<std::uint32_t>(parse_field(tokens[2], expression, 1, 31));
+    months = static_cast<std::uint16_t>(parse_field(tokens[3], expression, 1, 12, 1));
+    // 7 is accepted as Sunday too
+    auto dow = parse_field(tokens[4], expression, 0, 7);
+    days_of_week = static_cast<std::uint8_t>((dow | dow >> 7) & 0x7f);
 
-    verify_and_set(tokens[0], expression, minute, 0, 59);
-    verify_and_set(tokens[1], expression, hour, 0, 23);
-    verify_and_set(tokens[2], expression, day, 1, 31);
-    verify_and_set(tokens[3], expression, month, 1, 12, true);
-    verify_and_set(tokens[4], expression, day_of_week, 0, 6);
+    any_day = tokens[2][0] == '*';
+    any_day_of_week = tokens[4][0] == '*';
 }
 
 std::chrono::system_clock::time_point secman::Cron::cron_to_next() const
 {
-    // get current time as a tm object
-    auto now = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
-    std::tm next(*std::localtime(&now));
+    return cron_to_next(std::chrono::system_clock::now());
+}
+
+std::chrono::system_clock::time_point secman::Cron::cron_to_next(std::chrono::system_clock::time_point from) const
+{
+    auto from_t = std::chrono::system_clock::to_time_t(from);
+    std::tm now{};
+    localtime_r(&from_t, &now);
+
     // it will always at least run the next minute
-    next.tm_sec = 0;
-    add(next, std::chrono::minutes(1));
-    while (true)
-    {
-        if (month != -1 && next.tm_mon != month)
-        {
-            // add a month
-            // if this will bring us over a year, increment the year instead and reset the month
-            if (next.tm_mon + 1 > 11)
-            {
-                next.tm_mon = 0;
-                next.tm_year++;
-            }
-            else
-                next.tm_mon++;
+    int year = now.tm_year + 1900, month = now.tm_mon, day = now.tm_mday, hour = now.tm_hour, minute = now.tm_min + 1;
 
-            next.tm_mday = 1;
-            next.tm_hour = 0;
-            next.tm_min = 0;
-            continue;
-        }
-        if (day != -1 && next.tm_mday != day)
+    // every step jumps straight to the next accepted value of a field, or carries into the field above
+    while (year <= now.tm_year + 1900 + max_years)
+    {
+        auto month_bits = static_cast<std::uint64_t>(months) >> month;
+        if (month_bits == 0)
         {
-            add(next, std::chrono::hours(24));
-            next.tm_hour = 0;
-            next.tm_min = 0;
+            ++year;
+            month = 0, day = 1, hour = 0, minute = 0;
             continue;
         }
-        if (day_of_week != -1 && next.tm_wday != day_of_week)
+        auto next_month = month + count_trailing_zeros(month_bits);
+        if (next_month != month)
+            month = next_month, day = 1, hour = 0, minute = 0;
+
+        auto day_bits = day_mask(year, month) >> day;
+        if (day_bits == 0)
         {
-            add(next, std::chrono::hours(24));
-            next.tm_hour = 0;
-            next.tm_min = 0;
+            ++month;
+            day = 1, hour = 0, minute = 0;
             continue;
         }
-        if (hour != -1 && next.tm_hour != hour)
+        auto next_day = day + count_trailing_zeros(day_bits);
+        if (next_day != day)
+            day = next_day, hour = 0, minute = 0;
+
+        auto hour_bits = static_cast<std::uint64_t>(hours) >> hour;
+        if (hour_bits == 0)
         {
-            add(next, std::chrono::hours(1));
-            next.tm_min = 0;
+            ++day;
+            hour = 0, minute = 0;
             continue;
         }
-        if (minute != -1 && next.tm_min != minute)
+        auto next_hour = hour + count_trailing_zeros(hour_bits);
+        if (next_hour != hour)
+            hour = next_hour, minute = 0;
+
+        auto minute_bits = minutes >> minute;
+        if (minute_bits == 0)
         {
-            add(next, std::chrono::minutes(1));
+            ++hour;
+            minute = 0;
             continue;
         }
-        break;
+        minute += count_trailing_zeros(minute_bits);
+
+        std::tm next{};
+        next.tm_year = year - 1900;
+        next.tm_mon = month;
+        next.tm_mday = day;
+        next.tm_hour = hour;
+        next.tm_min = minute;
+        // telling mktime to figure out dst
+        next.tm_isdst = -1;
+        auto next_time = std::chrono::system_clock::from_time_t(std::mktime(&next));
+
+        // a local time repeated when the clock goes back may map before from, keep looking after it
+        if (next_time > from)
+            return next_time;
+        ++minute;
     }
 
-    // telling mktime to figure out dst
-    next.tm_isdst = -1;
-    return std::chrono::system_clock::from_time_t(std::mktime(&next));
-}
\ No newline at end of file
+    throw std::runtime_error("cron expression never matches");
+}
+
+bool secman::Cron::matches_ever() const
+{
+    // 28 years from 2000 go through every weekday of new year in both leap and common years
+    for (int year = 2000; year < 2000 + max_years; ++year)
+        for (int month = 0; month < 12; ++month)
+            if ((months >> month & 1) && day_mask(year, month) != 0)
+                return minutes != 0 && hours != 0;
+    return false;
+}
+
+bool secman::Cron::operator==(const Cron &other) const
+{
+    return minutes == other.minutes && hours == other.hours && days == other.days && months == other.months &&
+           days_of_week == other.days_of_week && any_day == other.any_day && any_day_of_week == other.any_day_of_week;
+}
+
+std::size_t std::hash<secman::Cron>::operator()(const secman::Cron &cron) const noexcept
+{
+    std::uint64_t h = cron.minutes;
+    for (std::uint64_t field : {std::uint64_t(cron.hours), std::uint64_t(cron.days), std::uint64_t(cron.months),
+                                std::uint64_t(cron.days_of_week), std::uint64_t(cron.any_day << 1 | cron.any_day_of_week)})
+        h = (h ^ field) * 0x9e3779b97f4a7c15;
+    return static_cast<std::size_t>(h ^ h >> 32);
+}
+
+std::uint64_t secman::Cron::day_mask(int year, int month) const
+{
+    // days of the month that fall on an accepted day of the week
+    auto first_weekday = weekday(year, month, 1);
+    std::uint64_t week_days = 0;
+    for (std::uint32_t dow = days_of_week; dow != 0; dow &= dow - 1)
+    {
+        auto first_day = 1 + (count_trailing_zeros(dow) - first_weekday + 7) % 7;
+        // bits 0, 7, 14, 21 and 28 moved to the first occurrence
+        week_days |= std::uint64_t(0x10204081) << first_day;
+    }
+
+    auto in_month = ((std::uint64_t(1) << (days_in_month(year, month) + 1)) - 1) & ~std::uint64_t(1);
+    auto matching = any_day || any_day_of_week ? days & week_days : days | week_days;
+    return matching & in_month;
+}
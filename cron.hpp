@@ -2,30 +2,58 @@
 #define SECMAN_CRON_H
 
 #include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <functional>
 #include <string>
-#include <sstream>
-#include <vector>
-#include <iterator>
+#include <string_view>
 
 namespace secman
 {
-    inline void add(std::tm &tm, std::chrono::system_clock::duration time);
-
-    inline void verify_and_set(const std::string& token, const std::string &expression,
-                               int &field, const int lower_bound, const int upper_bound, const bool adjust = false);
-
+    // expression compiled into one bitmask per field, bit n is set when the field accepts the value n
+    // supports *, single values, ranges a-b, lists a,b,c and steps */n, a-b/n, a/n
     class Cron
     {
     public:
-        explicit Cron(const std::string &expression);
+        explicit Cron(std::string_view expression);
+        // matches nothing, for filling in the masks of an already compiled expression
+        Cron();
 
-        // http://stackoverflow.com/a/322058/1284550
+        // first matching minute after now
         std::chrono::system_clock::time_point cron_to_next() const;
 
-        int minute, hour, day, month, day_of_week;
+        // first matching minute after from, computed by bit scans over the masks
+        std::chrono::system_clock::time_point cron_to_next(std::chrono::system_clock::time_point from) const;
+
+        // false if no date ever matches, like the 30th of February, without the time zone lookups of cron_to_next
+        bool matches_ever() const;
+
+        // same masks, so the same schedule however it was written
+        bool operator==(const Cron &other) const;
+
+        std::uint64_t minutes;      // 0 - 59
+        std::uint32_t hours;        // 0 - 23
+        std::uint32_t days;         // 1 - 31
+        std::uint16_t months;       // 0 - 11, as in tm_mon
+        std::uint8_t days_of_week;  // 0 - 6, Sunday is 0
+
+        // like the classic cron, when both day fields are restricted a day matches if either of them does
+        // a field starting with * does not restrict the day
+        bool any_day;
+        bool any_day_of_week;
+
+    private:
+        // days of the given month that match both day fields, bit d is day d
+        std::uint64_t day_mask(int year, int month) const;
     };
 }
 
+template<>
+struct std::hash<secman::Cron>
+{
+    std::size_t operator()(const secman::Cron &cron) const noexcept;
+};
+
 
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,101 @@
+#include "cron_index.hpp"
+
+constexpr int secman::CronIndex::minute_row;
+constexpr int secman::CronIndex::hour_row;
+constexpr int secman::CronIndex::day_row;
+constexpr int secman::CronIndex::month_row;
+constexpr int secman::CronIndex::day_of_week_row;
+constexpr int secman::CronIndex::either_day_row;
+constexpr int secman::CronIndex::n_rows;
+
+secman::CronIndex::CronIndex() : rows(n_rows), n_slots(0), n(0) {}
+
+secman::CronIndex::slot secman::CronIndex::insert(const Cron &cron)
+{
+    slot s;
+    if (free_slots.empty())
+    {
+        s = n_slots++;
+        if (s % 64 == 0)
+            for (auto &row : rows)
+                row.push_back(0);
+    }
+    else
+    {
+        s = free_slots.back();
+        free_slots.pop_back();
+    }
+    assign(s, cron);
+    ++n;
+    return s;
+}
+
+void secman::CronIndex::erase(slot s)
+{
+    for (auto &row : rows)
+        row[s / 64] &= ~(word(1) << s % 64);
+    free_slots.push_back(s);
+    --n;
+}
+
+void secman::CronIndex::match(const std::tm &tm, std::vector<word> &due) const
+{
+    if (due.size() < words())
+        due.resize(words(), 0);
+
+    // plain loops over equally sized word arrays, simple enough for the compiler to vectorize
+    const word *minute = rows[minute_row + tm.tm_min].data();
+    const word *hour = rows[hour_row + tm.tm_hour].data();
+    const word *day = rows[day_row + tm.tm_mday].data();
+    const word *month = rows[month_row + tm.tm_mon].data();
+    const word *day_of_week = rows[day_of_week_row + tm.tm_wday].data();
+    const word *either_day = rows[either_day_row].data();
+    word *out = due.data();
+
+    for (std::size_t i = 0, e = words(); i < e; ++i)
+    {
+        auto days = (day[i] & day_of_week[i]) | (either_day[i] & (day[i] | day_of_week[i]));
+        out[i] |= minute[i] & hour[i] & month[i] & days;
+    }
+}
+
+std::size_t secman::CronIndex::words() const
+{
+    return rows[0].size();
+}
+
+bool secman::CronIndex::empty() const
+{
+    return n == 0;
+}
+
+std::size_t secman::CronIndex::size() const
+{
+    return n;
+}
+
+void secman::CronIndex::assign(slot s, const Cron &cron)
+{
+    for (int minute = 0; minute < 60; ++minute)
+        if (cron.minutes >> minute & 1)
+            set(minute_row + minute, s);
+    for (int hour = 0; hour < 24; ++hour)
+        if (cron.hours >> hour & 1)
+            set(hour_row + hour, s);
+    for (int day = 1; day < 32; ++day)
+        if (cron.days >> day & 1)
+            set(day_row + day, s);
+    for (int month = 0; month < 12; ++month)
+        if (cron.months >> month & 1)
+            set(month_row + month, s);
+    for (int day_of_week = 0; day_of_week < 7; ++day_of_week)
+        if (cron.days_of_week >> day_of_week & 1)
+            set(day_of_week_row + day_of_week, s);
+    if (!cron.any_day && !cron.any_day_of_week)
+        set(either_day_row, s);
+}
+
+void secman::CronIndex::set(int row, slot s)
+{
+    rows[row][s / 64] |= word(1) << s % 64;
+}
@@ -0,0 +1,56 @@
+#ifndef SECMAN_CRON_INDEX_H
+#define SECMAN_CRON_INDEX_H
+
+#include <cstdint>
+#include <ctime>
+#include <vector>
+
+#include "cron.hpp"
+
+namespace secman
+{
+    // inverted index from every value of every cron field to the set of jobs accepting it
+    // jobs get dense slots, each set is a bitset over the slots
+    // the jobs due in a minute are found with a few word-wise ANDs over the whole table
+    class CronIndex
+    {
+    public:
+        using slot = std::uint32_t;
+        using word = std::uint64_t;
+
+        CronIndex();
+
+        slot insert(const Cron &cron);
+        void erase(slot s);
+
+        // ORs the jobs due at the given local time into due, which is resized to words() if needed
+        void match(const std::tm &tm, std::vector<word> &due) const;
+
+        // number of words in a bitset over all slots
+        std::size_t words() const;
+
+        bool empty() const;
+        std::size_t size() const;
+
+    private:
+        static constexpr int minute_row = 0;
+        static constexpr int hour_row = minute_row + 60;
+        static constexpr int day_row = hour_row + 24;
+        static constexpr int month_row = day_row + 32;
+        static constexpr int day_of_week_row = month_row + 12;
+        // jobs restricting both day fields, they match when either of them does
+        static constexpr int either_day_row = day_of_week_row + 7;
+        static constexpr int n_rows = either_day_row + 1;
+
+        std::vector<std::vector<word>> rows;
+        std::vector<slot> free_slots;
+        slot n_slots;
+        std::size_t n;
+
+        // slots are all zero when they are handed out, only the accepted values need setting
+        void assign(slot s, const Cron &cron);
+        void set(int row, slot s);
+    };
+}
+
+#endif
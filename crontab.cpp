@@ -0,0 +1,225 @@
+#include <algorithm>
+#include <cerrno>
+#include <future>
+#include <stdexcept>
+#include <system_error>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "crontab.hpp"
+
+namespace
+{
+    // small enough to spread over the threads, big enough that a chunk is not dominated by its bookkeeping
+    constexpr std::size_t chunk_size = 256 * 1024;
+
+    const char blanks[] = " \t\r";
+
+    struct Macro
+    {
+        std::string_view name;
+        const char *expression;
+    };
+
+    const Macro macros[] = {
+            {"@yearly",   "0 0 1 1 *"},
+            {"@annually", "0 0 1 1 *"},
+            {"@monthly",  "0 0 1 * *"},
+            {"@weekly",   "0 0 * * 0"},
+            {"@daily",    "0 0 * * *"},
+            {"@midnight", "0 0 * * *"},
+            {"@hourly",   "0 * * * *"},
+    };
+
+    std::string_view trim(std::string_view s)
+    {
+        auto begin = s.find_first_not_of(blanks);
+        if (begin == std::string_view::npos)
+            return {};
+        return s.substr(begin, s.find_last_not_of(blanks) - begin + 1);
+    }
+
+    // takes the next blank separated word off the front of s
+    std::string_view next_word(std::string_view &s)
+    {
+        s = s.substr(std::min(s.find_first_not_of(blanks), s.size()));
+        auto end = std::min(s.find_first_of(blanks), s.size());
+        auto word = s.substr(0, end);
+        s.remove_prefix(end);
+        return word;
+    }
+
+    void parse_line(std::string_view line, std::size_t number, const secman::LineFilter &known, secman::Crontab &out)
+    {
+        line = trim(line);
+        if (line.empty() || line[0] == '#')
+            return;
+        auto hash = std::hash<std::string_view>()(line);
+        if (known && known(hash))
+        {
+            out.known.push_back({number, hash, line});
+            return;
+        }
+        try
+        {
+            auto rest = line;
+            auto first = next_word(rest);
+            std::string_view expression;
+            if (first[0] == '@')
+            {
+                auto macro = std::find_if(std::begin(macros), std::end(macros),
+                                          [first](const Macro &m) { return m.name == first; });
+                if (macro == std::end(macros))
+                    throw std::runtime_error("unsupported schedule " + std::string(first));
+                expression = macro->expression;
+            }
+            else
+            {
+                if (first.find('=') != std::string_view::npos)
+                    throw std::runtime_error("environment settings are not supported");
+                for (int i = 1; i < 5; ++i)
+                    next_word(rest);
+                expression = line.substr(0, rest.data() - line.data());
+            }
+            secman::Cron cron(expression);
+            if (!cron.matches_ever())
+                throw std::runtime_error("cron expression never matches");
+            auto command = trim(rest);
+            if (command.empty())
+                throw std::runtime_error("no command");
+            out.entries.push_back({number, hash, cron, std::string(command)});
+        }
+        catch (const std::exception &e)
+        {
+            out.errors.push_back({number, e.what()});
+        }
+    }
+
+    // line numbers are counted from 1 within the chunk
+    secman::Crontab parse_chunk(std::string_view text, const secman::LineFilter &known)
+    {
+        secman::Crontab out;
+        while (!text.empty())
+        {
+            auto end = std::min(text.find('\n'), text.size());
+            parse_line(text.substr(0, end), ++out.lines, known, out);
+            text.remove_prefix(std::min(end + 1, text.size()));
+        }
+        return out;
+    }
+}
+
+secman::Crontab secman::parse_crontab(std::string_view text, tp::thread_pool &pool, const LineFilter &known)
+{
+    // chunks end after a newline, so no line is split
+    std::vector<std::string_view> chunks;
+    while (!text.empty())
+    {
+        auto end = text.size() <= chunk_size ? text.size() : std::min(text.find('\n', chunk_size), text.size() - 1) + 1;
+        chunks.push_back(text.substr(0, end));
+        text.remove_prefix(end);
+    }
+
+    std::vector<Crontab> parts;
+    if (chunks.size() <= 1 || pool.size() == 0)
+    {
+        for (auto chunk : chunks)
+            parts.push_back(parse_chunk(chunk, known));
+    }
+    else
+    {
+        std::vector<std::future<Crontab>> futures;
+        for (auto chunk : chunks)
+            futures.push_back(pool.push([chunk, &known](int) { return parse_chunk(chunk, known); }));
+        for (auto &future : futures)
+            parts.push_back(future.get());
+    }
+
+    // the line numbers of a chunk continue from the ones before it
+    Crontab crontab;
+    std::size_t entries = 0;
+    for (auto &part : parts)
+        entries += part.entries.size();
+    crontab.entries.reserve(entries);
+    for (auto &part : parts)
+    {
+        for (auto &entry : part.entries)
+        {
+            entry.line += crontab.lines;
+            crontab.entries.push_back(std::move(entry));
+        }
+        for (auto &error : part.errors)
+        {
+            error.line += crontab.lines;
+            crontab.errors.push_back(std::move(error));
+        }
+        for (auto &line : part.known)
+        {
+            line.line += crontab.lines;
+            crontab.known.push_back(line);
+        }
+        crontab.lines += part.lines;
+    }
+    return crontab;
+}
+
+secman::InputFile::InputFile(const std::string &path) : data(nullptr), size(0), mapped(false)
+{
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        throw std::system_error(errno, std::generic_category(), "open " + path);
+    open(fd, path);
+}
+
+secman::InputFile::InputFile(int fd) : data(nullptr), size(0), mapped(false)
+{
+    open(fd, "stdin");
+}
+
+secman::InputFile::~InputFile()
+{
+    if (mapped)
+        munmap(const_cast<char *>(data), size);
+}
+
+std::string_view secman::InputFile::view() const
+{
+    return {data, size};
+}
+
+void secman::InputFile::open(int fd, const std::string &name)
+{
+    struct stat st{};
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        void *map = mmap(nullptr, static_cast<std::size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED)
+        {
+            madvise(map, static_cast<std::size_t>(st.st_size), MADV_SEQUENTIAL);
+            data = static_cast<const char *>(map);
+            size = static_cast<std::size_t>(st.st_size);
+            mapped = true;
+            close(fd);
+            return;
+        }
+    }
+    char chunk[64 * 1024];
+    while (true)
+    {
+        ssize_t n = read(fd, chunk, sizeof(chunk));
+        if (n > 0)
+            buffer.append(chunk, static_cast<std::size_t>(n));
+        else if (n == 0)
+            break;
+        else if (errno != EINTR)
+        {
+            auto error = errno;
+            close(fd);
+            throw std::system_error(error, std::generic_category(), "read " + name);
+        }
+    }
+    close(fd);
+    data = buffer.data();
+    size = buffer.size();
+}
@@ -0,0 +1,79 @@
+#ifndef SECMAN_CRONTAB_H
+#define SECMAN_CRONTAB_H
+
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "cron.hpp"
+#include "tread_pool.hpp"
+
+namespace secman
+{
+    struct CrontabEntry
+    {
+        std::size_t line;  // from 1
+        std::size_t hash;  // of the line without the blanks around it, tells changed lines apart on a reload
+        Cron cron;
+        std::string command;
+    };
+
+    struct CrontabError
+    {
+        std::size_t line;
+        std::string message;
+    };
+
+    // a line that was not parsed because the caller already knew it
+    struct CrontabLine
+    {
+        std::size_t line;
+        std::size_t hash;
+        std::string_view text;  // points into the parsed text
+    };
+
+    struct Crontab
+    {
+        std::vector<CrontabEntry> entries;  // in line order
+        std::vector<CrontabError> errors;
+        std::vector<CrontabLine> known;
+        std::size_t lines = 0;
+    };
+
+    // tells from the hash of a line whether the caller has it already, called from several threads at once
+    using LineFilter = std::function<bool(std::size_t hash)>;
+
+    // parses crontab lines: "minute hour day month day-of-week command", or a macro like "@daily command"
+    // instead of the five fields. blank lines and # comments are skipped, environment settings
+    // and schedules that never match are reported as errors.
+    // the text is cut into chunks at line ends and the chunks are parsed on the pool.
+    // the lines accepted by known are only hashed, for reloading a crontab where most lines stay the same
+    Crontab parse_crontab(std::string_view text, tp::thread_pool &pool, const LineFilter &known = nullptr);
+
+    // the whole content of a file, mapped read only
+    // what can't be mapped, like a pipe on stdin, is read into memory instead
+    class InputFile
+    {
+    public:
+        explicit InputFile(const std::string &path);
+        // takes the fd, "-" on the command line
+        explicit InputFile(int fd);
+        InputFile(const InputFile &) = delete;
+        InputFile& operator=(const InputFile &) = delete;
+        ~InputFile();
+
+        std::string_view view() const;
+
+    private:
+        const char *data;
+        std::size_t size;
+        bool mapped;
+        std::string buffer;
+
+        void open(int fd, const std::string &name);
+    };
+}
+
+#endif
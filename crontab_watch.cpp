@@ -0,0 +1,171 @@
+#include <cerrno>
+#include <system_error>
+#include <dirent.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "crontab_watch.hpp"
+
+namespace
+{
+    // a write is usually followed by more: the rest of the file, a rename, the next file of the same run
+    constexpr std::chrono::milliseconds settle_time(100);
+
+    constexpr std::uint32_t events = IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR;
+
+    bool is_regular(const std::string &path)
+    {
+        struct stat st{};
+        return stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode);
+    }
+}
+
+secman::CrontabWatch::CrontabWatch(const std::vector<std::string> &paths, handler on_change)
+        : on_change(std::move(on_change)), done(false)
+{
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd == -1)
+        throw std::system_error(errno, std::generic_category(), "inotify_init1");
+    try
+    {
+        for (auto &path : paths)
+            add(path);
+    }
+    catch (...)
+    {
+        close(inotify_fd);
+        throw;
+    }
+    loop.watch(inotify_fd, [this]() { read_events(); });
+
+    thread = std::thread([this]()
+                         {
+                             for (auto &path : existing())
+                             {
+                                 reported.insert(path);
+                                 this->on_change(path);
+                             }
+                             while (!done)
+                             {
+                                 if (pending.empty())
+                                 {
+                                     loop.sleep();
+                                     continue;
+                                 }
+                                 if (std::chrono::system_clock::now() < settled)
+                                 {
+                                     loop.sleep_until(settled);
+                                     continue;
+                                 }
+                                 std::set<std::string> changed;
+                                 changed.swap(pending);
+                                 for (auto &path : changed)
+                                 {
+                                     reported.insert(path);
+                                     this->on_change(path);
+                                 }
+                             }
+                         });
+}
+
+secman::CrontabWatch::~CrontabWatch()
+{
+    done = true;
+    loop.interrupt();
+    thread.join();
+    loop.unwatch(inotify_fd);
+    close(inotify_fd);
+}
+
+void secman::CrontabWatch::add(const std::string &path)
+{
+    struct stat st{};
+    bool directory = stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+    std::string dir_path = path, name;
+    if (!directory)
+    {
+        // the file may not exist yet
+        auto slash = path.rfind('/');
+        dir_path = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+        name = path.substr(slash == std::string::npos ? 0 : slash + 1);
+    }
+
+    int wd = inotify_add_watch(inotify_fd, dir_path.c_str(), events);
+    if (wd == -1)
+        throw std::system_error(errno, std::generic_category(), "inotify_add_watch " + dir_path);
+    // a directory given more than once has one watch descriptor
+    auto &watched = directories[wd];
+    watched.path = dir_path;
+    if (directory)
+        watched.all_files = true;
+    else
+        watched.files.insert(name);
+}
+
+bool secman::CrontabWatch::accepts(const Directory &directory, const std::string &name) const
+{
+    if (directory.files.count(name) != 0)
+        return true;
+    return directory.all_files && !name.empty() && name.front() != '.' && name.back() != '~';
+}
+
+std::vector<std::string> secman::CrontabWatch::existing() const
+{
+    std::vector<std::string> paths;
+    for (auto &i : directories)
+    {
+        auto &directory = i.second;
+        for (auto &name : directory.files)
+            if (is_regular(directory.path + '/' + name))
+                paths.push_back(directory.path + '/' + name);
+        if (!directory.all_files)
+            continue;
+        if (DIR *dir = opendir(directory.path.c_str()))
+        {
+            while (dirent *entry = readdir(dir))
+            {
+                std::string name = entry->d_name;
+                if (directory.files.count(name) == 0 && accepts(directory, name) && is_regular(directory.path + '/' + name))
+                    paths.push_back(directory.path + '/' + name);
+            }
+            closedir(dir);
+        }
+    }
+    return paths;
+}
+
+void secman::CrontabWatch::read_events()
+{
+    alignas(inotify_event) char buffer[16 * 1024];
+    while (true)
+    {
+        ssize_t n = read(inotify_fd, buffer, sizeof(buffer));
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        for (char *p = buffer; p < buffer + n;)
+        {
+            auto event = reinterpret_cast<inotify_event *>(p);
+            p += sizeof(inotify_event) + event->len;
+            if (event->mask & IN_Q_OVERFLOW)
+            {
+                // events were lost: everything reported before or existing now is compared again
+                pending.insert(reported.begin(), reported.end());
+                for (auto &path : existing())
+                    pending.insert(path);
+                continue;
+            }
+            auto directory = directories.find(event->wd);
+            if (directory == directories.end() || event->len == 0 || (event->mask & IN_ISDIR))
+                continue;
+            std::string name = event->name;
+            if (accepts(directory->second, name))
+                pending.insert(directory->second.path + '/' + name);
+        }
+    }
+    settled = std::chrono::system_clock::now() + settle_time;
+    // the sleep goes on after the callbacks, it has to be woken up to wait for settled instead
+    if (!pending.empty())
+        loop.interrupt();
+}
@@ -0,0 +1,63 @@
+#ifndef SECMAN_CRONTAB_WATCH_H
+#define SECMAN_CRONTAB_WATCH_H
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "interruptable_sleep.hpp"
+
+namespace secman
+{
+    // watches crontab files, and directories whose files are all crontabs, with inotify
+    // a file is watched through its directory, so editors and config management that replace it by a rename are seen.
+    // in directories hidden files and backups ending in ~ are ignored
+    class CrontabWatch
+    {
+    public:
+        // path is the crontab that was written, created, replaced or removed
+        using handler = std::function<void(const std::string &path)>;
+
+        // every crontab that exists at the start is reported first, then the changes as they come
+        // the changes to a file are reported once they settled for a moment, on the watch thread
+        CrontabWatch(const std::vector<std::string> &paths, handler on_change);
+        CrontabWatch(const CrontabWatch &) = delete;
+        CrontabWatch& operator=(const CrontabWatch &) = delete;
+        ~CrontabWatch();
+
+    private:
+        struct Directory
+        {
+            std::string path;
+            bool all_files = false;
+            std::set<std::string> files;  // the watched ones when not all_files
+        };
+
+        handler on_change;
+        int inotify_fd;
+        std::unordered_map<int, Directory> directories;  // by watch descriptor
+
+        // changed crontabs waiting for the changes to settle, only used on the watch thread
+        std::set<std::string> pending;
+        std::chrono::system_clock::time_point settled;
+        // every crontab reported so far, for finding the removed ones after lost events
+        std::set<std::string> reported;
+
+        std::atomic<bool> done;
+        InterruptableSleep loop;
+        std::thread thread;
+
+        void add(const std::string &path);
+        bool accepts(const Directory &directory, const std::string &name) const;
+        // the crontabs that exist now
+        std::vector<std::string> existing() const;
+        void read_events();
+    };
+}
+
+#endif
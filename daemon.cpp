@@ -0,0 +1,450 @@
+#include <sys/wait.h>
+#include <unistd.h>
+#include <iostream>
+#include "daemon.hpp"
+
+namespace
+{
+    sigset_t block_stop_signals()
+    {
+        sigset_t signals;
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGINT);
+        sigaddset(&signals, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+        return signals;
+    }
+
+    // log files are rotated at 64 MiB, 5 old ones are kept
+    constexpr std::size_t max_log_size = 64 << 20;
+    constexpr int kept_logs = 5;
+
+    secman::RunPolicy policy_of(const secman::ControlRequest &request)
+    {
+        if (request.overlap > static_cast<std::uint8_t>(secman::Overlap::replace))
+            throw std::runtime_error("unknown overlap policy " + std::to_string(request.overlap));
+        if (request.group.size() > secman::Journal::max_group_size)
+            throw std::runtime_error("group name too long: " + request.group);
+        secman::RunPolicy policy;
+        policy.overlap = static_cast<secman::Overlap>(request.overlap);
+        policy.group = request.group;
+        policy.jitter = std::chrono::milliseconds(request.jitter);
+        policy.priority = request.priority;
+        return policy;
+    }
+
+    // a load lists this many of its rejected lines, the rest are only counted
+    constexpr std::size_t reported_errors = 20;
+
+    std::uint64_t microseconds(std::chrono::steady_clock::duration d)
+    {
+        return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(d).count());
+    }
+}
+
+secman::Daemon::Daemon(const Options &options)
+        : stop_signals(block_stop_signals()), log_dir(options.log_dir),
+          journal(options.journal_path.empty() ? nullptr : std::make_unique<Journal>(options.journal_path)),
+          scheduler(options.threads, TimerBackend::timing_wheel, options.placement)
+{
+    if (options.max_threads > options.threads)
+        scheduler.pool().autoscale(static_cast<int>(options.threads), static_cast<int>(options.max_threads));
+    for (auto &limit : options.group_limits)
+        scheduler.limit_group(limit.first, limit.second);
+    for (auto &weight : options.group_weights)
+        scheduler.set_group_weight(weight.first, weight.second);
+    scheduler.limit_rate(options.start_rate);
+    scheduler.set_slack(options.slack);
+    for (auto &rate : options.group_rates)
+        scheduler.limit_group_rate(rate.first, rate.second);
+    scheduler.record_task_latency(options.task_latency);
+    restore();
+    if (!options.load_path.empty())
+    {
+        auto start = std::chrono::steady_clock::now();
+        auto file = options.load_path == "-" ? std::make_unique<InputFile>(STDIN_FILENO)
+                                             : std::make_unique<InputFile>(options.load_path);
+        auto response = load(file->view(), std::chrono::steady_clock::now() - start, false);
+        std::cerr << "loaded " << options.load_path << ':';
+        for (auto &stat : response.stats)
+            std::cerr << ' ' << stat.first << ' ' << stat.second;
+        std::cerr << std::endl << response.error;
+    }
+    if (!options.watch_paths.empty())
+        watch = std::make_unique<CrontabWatch>(options.watch_paths, [this](const std::string &path)
+        {
+            try
+            {
+                reload(path);
+            }
+            catch (const std::exception &e)
+            {
+                std::cerr << path << ": " << e.what() << std::endl;
+            }
+        });
+    if (!options.metrics_path.empty())
+        metrics = std::make_unique<MetricsFile>(options.metrics_path, options.metrics_interval, scheduler);
+    server = std::make_unique<ControlServer>(options.socket_path,
+                                             [this](const ControlRequest &request) { return handle(request); });
+}
+
+void secman::Daemon::run()
+{
+    int signal;
+    sigwait(&stop_signals, &signal);
+}
+
+std::function<void()> secman::Daemon::launch(const std::string &command, TaskId id)
+{
+    ProcessRunner runner = [&]()
+    {
+        std::lock_guard<std::mutex> lg(m);
+        auto i = runners.find(command);
+        if (i == runners.end())
+            i = runners.emplace(command, ProcessRunner(command)).first;
+        return i->second;
+    }();
+    std::shared_ptr<JobLog> log;
+    if (!log_dir.empty())
+        log = std::make_shared<JobLog>(log_dir + '/' + std::to_string(id) + ".log", max_log_size, kept_logs);
+    return [this, runner, log]()
+    {
+        auto run = Scheduler::current_run();
+        // 0 until started, -1 once reaped, so a late stop can't hit a reused pid
+        auto child = std::make_shared<std::atomic<pid_t>>(0);
+        auto on_exit = [runner, run, child](pid_t, int status)
+        {
+            child->store(-1);
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+                std::cerr << runner.command() << ": exited with status " << status << std::endl;
+        };
+        pid_t pid = log ? supervisor.start(runner, log, on_exit) : supervisor.start(runner, on_exit);
+        pid_t not_started = 0;
+        child->compare_exchange_strong(not_started, pid);
+        if (run)
+            run->on_stop([child]()
+                         {
+                             auto pid = child->load();
+                             if (pid > 0)
+                                 kill(pid, SIGTERM);
+                         });
+    };
+}
+
+std::function<void()> secman::Daemon::once(TaskId id, std::function<void()> job)
+{
+    return [this, id, job]()
+    {
+        job();
+        if (journal)
+            journal->remove(id);
+        std::lock_guard<std::mutex> lg(m);
+        commands.erase(id);
+    };
+}
+
+void secman::Daemon::restore()
+{
+    if (!journal)
+        return;
+    std::vector<TimerQueue::entry> saved;
+    for (auto &job : journal->load())
+    {
+        std::shared_ptr<Task> task;
+        if (job.kind == Journal::Kind::cron)
+            task = std::make_shared<CronTask>(job.cron, launch(job.command, job.id));
+        else
+            task = std::make_shared<InTask>(once(job.id, launch(job.command, job.id)));
+        task->id = job.id;
+        task->policy.overlap = static_cast<Overlap>(job.overlap);
+        task->policy.group = std::move(job.group);
+        task->policy.jitter = std::chrono::milliseconds(job.jitter);
+        task->policy.priority = job.priority;
+        commands.emplace(job.id, std::move(job.command));
+        saved.emplace_back(job.next, std::move(task));
+    }
+    // the cron masks come compiled from the journal and everything goes in with one pass of the dispatcher
+    scheduler.restore(std::move(saved));
+}
+
+secman::TaskId secman::Daemon::add_at(std::chrono::system_clock::time_point time, const std::string &command,
+                                      const RunPolicy &policy)
+{
+    // the id is reserved first so the job knows it, and is in the journal before it can run
+    auto id = scheduler.reserve_id();
+    std::shared_ptr<Task> task = std::make_shared<InTask>(once(id, launch(command, id)));
+    task->id = id;
+    task->policy = policy;
+    if (journal)
+        journal->add({id, Journal::Kind::at, time, Cron(), command, static_cast<std::uint8_t>(policy.overlap), policy.group,
+                      static_cast<std::uint32_t>(policy.jitter.count()), policy.priority});
+    {
+        std::lock_guard<std::mutex> lg(m);
+        commands.emplace(id, command);
+    }
+    scheduler.restore({{time, std::move(task)}});
+    return id;
+}
+
+secman::TaskId secman::Daemon::add_cron(const std::string &expression, const std::string &command,
+                                        const RunPolicy &policy)
+{
+    Cron cron(expression);
+    // fails early on expressions that never match
+    cron.cron_to_next();
+    auto id = scheduler.reserve_id();
+    std::shared_ptr<Task> task = std::make_shared<CronTask>(cron, launch(command, id));
+    task->id = id;
+    task->policy = policy;
+    if (journal)
+        journal->add({id, Journal::Kind::cron, {}, cron, command, static_cast<std::uint8_t>(policy.overlap), policy.group,
+                      static_cast<std::uint32_t>(policy.jitter.count()), policy.priority});
+    {
+        std::lock_guard<std::mutex> lg(m);
+        commands.emplace(id, command);
+    }
+    scheduler.restore({{{}, std::move(task)}});
+    return id;
+}
+
+bool secman::Daemon::remove(TaskId id)
+{
+    if (!scheduler.cancel(id))
+        return false;
+    if (journal)
+        journal->remove(id);
+    std::lock_guard<std::mutex> lg(m);
+    commands.erase(id);
+    return true;
+}
+
+secman::ControlResponse secman::Daemon::load(std::string_view text, std::chrono::steady_clock::duration map_time,
+                                             bool journaled)
+{
+    auto parse_start = std::chrono::steady_clock::now();
+    auto crontab = parse_crontab(text, scheduler.pool());
+
+    auto build_start = std::chrono::steady_clock::now();
+    std::vector<TimerQueue::entry> jobs;
+    std::vector<TaskId> ids;
+    jobs.reserve(crontab.entries.size());
+    ids.reserve(crontab.entries.size());
+    for (auto &entry : crontab.entries)
+    {
+        auto id = scheduler.reserve_id();
+        std::shared_ptr<Task> task = std::make_shared<CronTask>(entry.cron, launch(entry.command, id));
+        task->id = id;
+        if (journal && journaled)
+            journal->add({id, Journal::Kind::cron, {}, entry.cron, entry.command});
+        jobs.emplace_back(std::chrono::system_clock::time_point(), std::move(task));
+        ids.push_back(id);
+    }
+    {
+        std::lock_guard<std::mutex> lg(m);
+        for (std::size_t i = 0; i < ids.size(); ++i)
+            commands.emplace(ids[i], std::move(crontab.entries[i].command));
+    }
+    // the whole crontab reaches the dispatcher as one request
+    scheduler.restore(std::move(jobs));
+    auto end = std::chrono::steady_clock::now();
+
+    ControlResponse response{ControlResponse::Type::stats};
+    response.stats = {{"lines", crontab.lines},
+                      {"jobs", ids.size()},
+                      {"errors", crontab.errors.size()},
+                      {"map_us", microseconds(map_time)},
+                      {"parse_us", microseconds(build_start - parse_start)},
+                      {"schedule_us", microseconds(end - build_start)}};
+    for (std::size_t i = 0; i < crontab.errors.size() && i < reported_errors; ++i)
+        response.error += "line " + std::to_string(crontab.errors[i].line) + ": " + crontab.errors[i].message + '\n';
+    return response;
+}
+
+void secman::Daemon::reload(const std::string &path)
+{
+    auto start = std::chrono::steady_clock::now();
+    std::unique_ptr<InputFile> file;
+    try
+    {
+        file = std::make_unique<InputFile>(path);
+    }
+    catch (const std::system_error &e)
+    {
+        // a removed crontab takes its jobs with it, so does one that can't be read anymore
+        if (e.code() != std::errc::no_such_file_or_directory)
+            std::cerr << e.what() << std::endl;
+    }
+    auto text = file ? file->view() : std::string_view();
+    auto hash = std::hash<std::string_view>()(text);
+    auto loaded = watched.find(path);
+    if (loaded == watched.end() ? !file : file && loaded->second.hash == hash)
+        return;
+
+    auto old_lines = loaded == watched.end() ? std::unordered_multimap<std::size_t, TaskId>()
+                                             : std::move(loaded->second.lines);
+    // only the lines that were not there before are parsed
+    auto crontab = parse_crontab(text, scheduler.pool(),
+                                 [&old_lines](std::size_t hash) { return old_lines.count(hash) != 0; });
+
+    // the lines still there keep their jobs
+    std::unordered_multimap<std::size_t, TaskId> lines;
+    lines.reserve(crontab.known.size() + crontab.entries.size());
+    for (auto &line : crontab.known)
+    {
+        auto old = old_lines.find(line.hash);
+        if (old != old_lines.end())
+        {
+            lines.emplace(line.hash, old->second);
+            old_lines.erase(old);
+            continue;
+        }
+        // a line that now appears more often than before
+        auto repeated = parse_crontab(line.text, scheduler.pool());
+        for (auto &entry : repeated.entries)
+            crontab.entries.push_back({line.line, entry.hash, entry.cron, std::move(entry.command)});
+    }
+    std::size_t unchanged = lines.size();
+
+    // the jobs of the lines that are gone are cancelled, a changed line is one of those and a new one.
+    // a run of a cancelled job may still be going, the new jobs get ids and logs of their own
+    std::vector<TaskId> cancelled;
+    cancelled.reserve(old_lines.size());
+    for (auto &old : old_lines)
+        cancelled.push_back(old.second);
+    if (!cancelled.empty())
+        scheduler.cancel(cancelled);
+
+    std::vector<TimerQueue::entry> jobs;
+    std::vector<TaskId> ids;
+    for (auto &entry : crontab.entries)
+    {
+        auto id = scheduler.reserve_id();
+        std::shared_ptr<Task> task = std::make_shared<CronTask>(entry.cron, launch(entry.command, id));
+        task->id = id;
+        jobs.emplace_back(std::chrono::system_clock::time_point(), std::move(task));
+        ids.push_back(id);
+        lines.emplace(entry.hash, id);
+    }
+    {
+        std::lock_guard<std::mutex> lg(m);
+        for (auto id : cancelled)
+            commands.erase(id);
+        for (std::size_t i = 0; i < ids.size(); ++i)
+            commands.emplace(ids[i], crontab.entries[i].command);
+    }
+    if (!jobs.empty())
+        scheduler.restore(std::move(jobs));
+
+    if (file)
+        watched[path] = {hash, std::move(lines)};
+    else
+        watched.erase(path);
+
+    std::cerr << "reloaded " << path << ": " << unchanged << " unchanged, "
+              << ids.size() << " added, " << cancelled.size() << " removed, " << crontab.errors.size() << " errors in "
+              << microseconds(std::chrono::steady_clock::now() - start) << " us" << std::endl;
+    for (std::size_t i = 0; i < crontab.errors.size() && i < reported_errors; ++i)
+        std::cerr << path << ": line " << crontab.errors[i].line << ": " << crontab.errors[i].message << std::endl;
+}
+
+secman::ControlResponse secman::Daemon::handle(const ControlRequest &request)
+{
+    using Type = ControlRequest::Type;
+    ControlResponse response{ControlResponse::Type::ok};
+    switch (request.type)
+    {
+        case Type::add_at:
+            response.type = ControlResponse::Type::id;
+            response.id = add_at(std::chrono::system_clock::time_point(std::chrono::system_clock::duration(request.time)),
+                                 request.command, policy_of(request));
+            break;
+        case Type::add_cron:
+            response.type = ControlResponse::Type::id;
+            response.id = add_cron(request.expression, request.command, policy_of(request));
+            break;
+        case Type::list:
+        {
+            std::vector<TaskInfo> infos;
+            if (request.id == 0)
+                infos = scheduler.list();
+            else if (auto info = scheduler.lookup(request.id))
+                infos.push_back(*info);
+            response.type = ControlResponse::Type::list;
+            std::lock_guard<std::mutex> lg(m);
+            for (auto &info : infos)
+            {
+                auto command = commands.find(info.id);
+                response.entries.push_back({info.id, !info.next, info.next ? info.next->time_since_epoch().count() : 0,
+                                            info.recur, command != commands.end() ? command->second : std::string()});
+            }
+            break;
+        }
+        case Type::remove:
+            if (!remove(request.id))
+            {
+                response.type = ControlResponse::Type::error;
+                response.error = "no task with id " + std::to_string(request.id);
+            }
+            break;
+        case Type::stats:
+        {
+            auto stats = scheduler.stats();
+            response.type = ControlResponse::Type::stats;
+            response.stats = {{"tasks", stats.tasks},
+                              {"queued", stats.queued},
+                              {"cron_tasks", stats.cron_tasks},
+                              {"cron_schedules", stats.cron_schedules},
+                              {"threads", static_cast<std::uint64_t>(stats.threads)},
+                              {"idle_threads", static_cast<std::uint64_t>(stats.idle_threads)},
+                              {"running", stats.running},
+                              {"skipped", stats.skipped},
+                              {"throttled", stats.throttled},
+                              {"delayed", stats.delayed},
+                              {"wakeups", stats.wakeups},
+                              {"pool_queued", stats.pool_queued},
+                              {"pool_wakeups", stats.pool_wakeups},
+                              {"dispatcher_cpu_us", static_cast<std::uint64_t>(
+                                      std::chrono::duration_cast<std::chrono::microseconds>(stats.dispatcher_cpu).count())},
+                              {"running_processes", supervisor.running()},
+                              {"journaled", journal ? journal->size() : 0}};
+            auto latency = scheduler.latency();
+            for (auto step : {std::make_pair("lateness.", &latency.lateness), std::make_pair("wait.", &latency.wait),
+                              std::make_pair("run.", &latency.run)})
+            {
+                std::string prefix = step.first;
+                auto &histogram = *step.second;
+                response.stats.insert(response.stats.end(), {
+                        {prefix + "count", histogram.count()},
+                        {prefix + "p50_us", microseconds(histogram.percentile(0.5))},
+                        {prefix + "p99_us", microseconds(histogram.percentile(0.99))},
+                        {prefix + "max_us", microseconds(histogram.max())}});
+            }
+            for (auto &group : scheduler.group_stats())
+            {
+                auto prefix = "group." + group.name + ".";
+                response.stats.insert(response.stats.end(), {
+                        {prefix + "limit", group.limit},
+                        {prefix + "weight", group.weight},
+                        {prefix + "running", group.running},
+                        {prefix + "waiting", group.waiting},
+                        {prefix + "queued", group.queued},
+                        {prefix + "started", group.started},
+                        {prefix + "mean_wait_us", static_cast<std::uint64_t>(
+                                std::chrono::duration_cast<std::chrono::microseconds>(group.mean_wait).count())},
+                        {prefix + "max_wait_us", static_cast<std::uint64_t>(
+                                std::chrono::duration_cast<std::chrono::microseconds>(group.max_wait).count())}});
+            }
+            break;
+        }
+        case Type::load:
+        {
+            auto start = std::chrono::steady_clock::now();
+            std::unique_ptr<InputFile> file;
+            if (!request.path.empty())
+                file = std::make_unique<InputFile>(request.path);
+            response = load(file ? file->view() : std::string_view(request.text), std::chrono::steady_clock::now() - start);
+            break;
+        }
+    }
+    return response;
+}
@@ -0,0 +1,113 @@
+#ifndef SECMAN_DAEMON_H
+#define SECMAN_DAEMON_H
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <signal.h>
+
+#include "scheduler.hpp"
+#include "supervisor.hpp"
+#include "journal.hpp"
+#include "control.hpp"
+#include "crontab.hpp"
+#include "crontab_watch.hpp"
+#include "metrics.hpp"
+
+namespace secman
+{
+    // the long running secman: schedules command jobs and takes requests from the clients on the control socket
+    class Daemon
+    {
+    public:
+        struct Options
+        {
+            std::string socket_path;
+            std::string journal_path;  // no journal if empty
+            std::string log_dir;       // job output is not captured if empty
+            std::string load_path;     // a crontab loaded at startup, "-" for stdin. its jobs are not journaled
+            // crontab files and directories of them, their jobs follow the files as they change
+            std::vector<std::string> watch_paths;
+            // at most that many runs of the jobs of each named group at once
+            std::vector<std::pair<std::string, unsigned int>> group_limits;
+            // shares of the worker threads while they have a backlog, see Scheduler::set_group_weight
+            std::vector<std::pair<std::string, unsigned int>> group_weights;
+            // job starts per second, overall and for each named group, 0 for no limit
+            double start_rate = 0;
+            std::vector<std::pair<std::string, double>> group_rates;
+            // how late the timers may fire to share wake ups, see RunPolicy::slack
+            std::chrono::milliseconds slack{0};
+            unsigned int threads = 4;
+            // above threads the pool grows up to max_threads when jobs wait for a thread, and shrinks back when idle.
+            // 0 for a fixed size
+            unsigned int max_threads = 0;
+            // the cpus and NUMA nodes of the workers and the core of the dispatcher
+            tp::placement placement;
+            // the metrics in the Prometheus text format are written there every metrics_interval, none if empty
+            std::string metrics_path;
+            std::chrono::seconds metrics_interval{15};
+            // the latencies of each job on their own too, see Scheduler::record_task_latency
+            bool task_latency = false;
+        };
+
+        explicit Daemon(const Options &options);
+
+        // serves until SIGINT or SIGTERM
+        void run();
+
+    private:
+        // blocked before any thread is started, so they all inherit it and only run() receives them
+        sigset_t stop_signals;
+
+        std::string log_dir;
+
+        // the members are destroyed bottom up: the control server first, the jobs of the scheduler
+        // still use the supervisor and the journal
+        std::unique_ptr<Journal> journal;
+        Supervisor supervisor;
+
+        std::mutex m;
+        // jobs with the same command share the runner, it is split and looked up once
+        std::unordered_map<std::string, ProcessRunner> runners;
+        std::unordered_map<TaskId, std::string> commands;
+
+        // the jobs scheduled from a watched crontab, only used on the watch thread
+        struct WatchedCrontab
+        {
+            std::size_t hash;  // of the whole file
+            std::unordered_multimap<std::size_t, TaskId> lines;  // by line hash
+        };
+        std::unordered_map<std::string, WatchedCrontab> watched;
+
+        Scheduler scheduler;
+        std::unique_ptr<MetricsFile> metrics;
+        std::unique_ptr<CrontabWatch> watch;
+        std::unique_ptr<ControlServer> server;
+
+        // a job that starts the command and returns right away, its output goes to <log_dir>/<id>.log
+        // its run lasts until the process exits and a replacing run stops it with SIGTERM
+        std::function<void()> launch(const std::string &command, TaskId id);
+        // a one-shot job that forgets itself once it ran
+        std::function<void()> once(TaskId id, std::function<void()> job);
+
+        // schedules the jobs saved by earlier runs with their ids
+        void restore();
+
+        TaskId add_at(std::chrono::system_clock::time_point time, const std::string &command, const RunPolicy &policy);
+        TaskId add_cron(const std::string &expression, const std::string &command, const RunPolicy &policy);
+        bool remove(TaskId id);
+        // schedules every job of a crontab, answers with the counts, the time of each phase and the rejected lines
+        // map_time is what it took to get the text in memory.
+        // the jobs of the crontab given at startup are not journaled, the file brings them back on the next start
+        ControlResponse load(std::string_view text, std::chrono::steady_clock::duration map_time, bool journaled = true);
+        // brings the jobs of a watched crontab in line with the file: only the lines that changed are touched,
+        // the jobs of the others keep running on their schedule.
+        // the jobs of watched crontabs are not journaled, the files are where they come from
+        void reload(const std::string &path);
+
+        ControlResponse handle(const ControlRequest &request);
+    };
+}
+
+#endif
@@ -0,0 +1,115 @@
+#include "histogram.hpp"
+
+constexpr std::size_t secman::Histogram::n_buckets;
+
+secman::Histogram::Histogram() : sum(0), max(0)
+{
+    for (auto &count : counts)
+        count.store(0, std::memory_order_relaxed);
+}
+
+void secman::Histogram::record(std::chrono::nanoseconds value)
+{
+    auto ns = static_cast<std::uint64_t>(std::max<std::int64_t>(value.count(), 0));
+    counts[bucket_of(ns)].fetch_add(1, std::memory_order_relaxed);
+    sum.fetch_add(ns, std::memory_order_relaxed);
+    auto seen = max.load(std::memory_order_relaxed);
+    while (ns > seen && !max.compare_exchange_weak(seen, ns, std::memory_order_relaxed));
+}
+
+void secman::Histogram::record_alone(std::chrono::nanoseconds value)
+{
+    auto ns = static_cast<std::uint64_t>(std::max<std::int64_t>(value.count(), 0));
+    auto &count = counts[bucket_of(ns)];
+    count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    sum.store(sum.load(std::memory_order_relaxed) + ns, std::memory_order_relaxed);
+    if (ns > max.load(std::memory_order_relaxed))
+        max.store(ns, std::memory_order_relaxed);
+}
+
+std::size_t secman::Histogram::bucket_of(std::uint64_t ns)
+{
+    if (ns < (std::uint64_t(2) << sub_bits))
+        return static_cast<std::size_t>(ns);
+    ns = std::min(ns, (std::uint64_t(1) << max_bits) - 1);
+    // the top sub_bits + 1 bits of the value, counted from the highest one, pick the bucket within its power of two
+    int shift = 63 - __builtin_clzll(ns) - sub_bits;
+    return (static_cast<std::size_t>(shift) << sub_bits) + static_cast<std::size_t>(ns >> shift);
+}
+
+std::uint64_t secman::Histogram::lowest(std::size_t bucket)
+{
+    if (bucket < (std::size_t(2) << sub_bits))
+        return bucket;
+    auto shift = static_cast<int>(bucket >> sub_bits) - 1;
+    return static_cast<std::uint64_t>(bucket - (static_cast<std::size_t>(shift) << sub_bits)) << shift;
+}
+
+std::uint64_t secman::Histogram::highest(std::size_t bucket)
+{
+    if (bucket < (std::size_t(2) << sub_bits))
+        return bucket;
+    auto shift = static_cast<int>(bucket >> sub_bits) - 1;
+    return lowest(bucket) + (std::uint64_t(1) << shift) - 1;
+}
+
+secman::HistogramSnapshot::HistogramSnapshot() : counts(Histogram::n_buckets, 0), total(0), sum_ns(0), max_ns(0) {}
+
+void secman::HistogramSnapshot::merge(const Histogram &histogram)
+{
+    // the buckets are read one by one while they may still be written, the total is what was read
+    for (std::size_t i = 0; i < Histogram::n_buckets; ++i)
+    {
+        auto n = histogram.counts[i].load(std::memory_order_relaxed);
+        counts[i] += n;
+        total += n;
+    }
+    sum_ns += histogram.sum.load(std::memory_order_relaxed);
+    max_ns = std::max(max_ns, histogram.max.load(std::memory_order_relaxed));
+}
+
+void secman::HistogramSnapshot::merge(const HistogramSnapshot &other)
+{
+    for (std::size_t i = 0; i < Histogram::n_buckets; ++i)
+        counts[i] += other.counts[i];
+    total += other.total;
+    sum_ns += other.sum_ns;
+    max_ns = std::max(max_ns, other.max_ns);
+}
+
+std::uint64_t secman::HistogramSnapshot::count() const
+{
+    return total;
+}
+
+std::chrono::nanoseconds secman::HistogramSnapshot::sum() const
+{
+    return std::chrono::nanoseconds(sum_ns);
+}
+
+std::chrono::nanoseconds secman::HistogramSnapshot::max() const
+{
+    return std::chrono::nanoseconds(max_ns);
+}
+
+std::chrono::nanoseconds secman::HistogramSnapshot::mean() const
+{
+    return std::chrono::nanoseconds(total == 0 ? 0 : sum_ns / total);
+}
+
+std::chrono::nanoseconds secman::HistogramSnapshot::percentile(double q) const
+{
+    if (total == 0)
+        return std::chrono::nanoseconds(0);
+    // the rank of the value, from 1
+    auto rank = static_cast<std::uint64_t>(std::clamp(q, 0.0, 1.0) * static_cast<double>(total) + 0.5);
+    rank = std::clamp<std::uint64_t>(rank, 1, total);
+    std::uint64_t seen = 0;
+    for (std::size_t i = 0; i < Histogram::n_buckets; ++i)
+    {
+        seen += counts[i];
+        if (seen >= rank)
+            return std::chrono::nanoseconds(std::min(Histogram::highest(i), max_ns));
+    }
+    return std::chrono::nanoseconds(max_ns);
+}
@@ -0,0 +1,124 @@
+#ifndef SECMAN_HISTOGRAM_H
+#define SECMAN_HISTOGRAM_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace secman
+{
+    class HistogramSnapshot;
+
+    // durations counted in log-linear buckets like an HdrHistogram: below 32 ns one bucket per nanosecond,
+    // above that 16 buckets per power of two, so a value is known to within 1/16 of it.
+    // covers up to 2^46 ns, about 19.5 hours, longer ones are counted in the last bucket.
+    // it can be read while it is recorded to
+    class alignas(64) Histogram
+    {
+    public:
+        static constexpr int sub_bits = 4;
+        static constexpr int max_bits = 46;
+        static constexpr std::size_t n_buckets = static_cast<std::size_t>(max_bits - sub_bits + 1) << sub_bits;
+
+        Histogram();
+        Histogram(const Histogram &) = delete;
+        Histogram& operator=(const Histogram &) = delete;
+
+        // negative durations, like from a clock that was set back, count as 0
+        // with relaxed atomic adds, from any thread
+        void record(std::chrono::nanoseconds value);
+        // with plain stores, a few times cheaper, for when no other thread records to it like in a PerThread
+        void record_alone(std::chrono::nanoseconds value);
+
+        static std::size_t bucket_of(std::uint64_t ns);
+        // the smallest and the largest value counted in the bucket
+        static std::uint64_t lowest(std::size_t bucket);
+        static std::uint64_t highest(std::size_t bucket);
+
+    private:
+        friend class HistogramSnapshot;
+
+        std::atomic<std::uint64_t> counts[n_buckets];
+        std::atomic<std::uint64_t> sum;  // in ns
+        std::atomic<std::uint64_t> max;
+    };
+
+    // plain copy of one or more histograms added together, for reading
+    class HistogramSnapshot
+    {
+    public:
+        HistogramSnapshot();
+
+        void merge(const Histogram &histogram);
+        void merge(const HistogramSnapshot &other);
+
+        std::uint64_t count() const;
+        std::chrono::nanoseconds sum() const;
+        std::chrono::nanoseconds max() const;
+        std::chrono::nanoseconds mean() const;
+        // the value below which the fraction q of the values are, 0 <= q <= 1, as the highest value of its bucket
+        std::chrono::nanoseconds percentile(double q) const;
+
+    private:
+        std::vector<std::uint64_t> counts;  // by bucket
+        std::uint64_t total;
+        std::uint64_t sum_ns;
+        std::uint64_t max_ns;
+    };
+
+    // one T for each thread that asks for it, so the threads that record often don't write to the same cache lines.
+    // they are kept until the PerThread is gone, for reading them all together
+    template<typename T>
+    class PerThread
+    {
+    public:
+        PerThread() : id(++last_id) {}
+        PerThread(const PerThread &) = delete;
+        PerThread& operator=(const PerThread &) = delete;
+
+        // the T of the calling thread, made on its first call
+        T &local()
+        {
+            // the last one used on this thread, looked up again when another PerThread was used in between
+            thread_local std::uint64_t cached_id = 0;
+            thread_local T *cached = nullptr;
+            if (cached_id == id)
+                return *cached;
+            std::lock_guard<std::mutex> lg(m);
+            auto self = std::this_thread::get_id();
+            auto found = std::find_if(all.begin(), all.end(),
+                                      [self](const std::pair<std::thread::id, std::unique_ptr<T>> &i) { return i.first == self; });
+            if (found == all.end())
+                found = all.emplace(all.end(), self, std::unique_ptr<T>(new T()));
+            cached_id = id;
+            cached = found->second.get();
+            return *cached;
+        }
+
+        // calls f with every T, the threads may still be writing to them
+        template<typename F>
+        void for_each(F &&f)
+        {
+            std::lock_guard<std::mutex> lg(m);
+            for (auto &i : all)
+                f(*i.second);
+        }
+
+    private:
+        // never reused, unlike the address of a PerThread, so a cached pointer can't point into a destroyed one
+        static inline std::atomic<std::uint64_t> last_id{0};
+
+        std::uint64_t id;
+        std::mutex m;
+        // a thread that ended keeps its T, the ids of threads can come back but then it's just used again
+        std::vector<std::pair<std::thread::id, std::unique_ptr<T>>> all;
+    };
+}
+
+#endif
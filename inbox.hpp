@@ -0,0 +1,70 @@
+#ifndef SECMAN_INBOX_H
+#define SECMAN_INBOX_H
+
+#include <atomic>
+#include <memory>
+#include <utility>
+
+namespace secman
+{
+    // multi producer, single consumer queue whose producers never block
+    // producers push onto a lock-free stack, the consumer takes the whole stack with one exchange
+    // and reverses it, so the messages of each producer come out in the order they were pushed
+    template<typename T>
+    class Inbox
+    {
+    public:
+        Inbox() : head(nullptr) {}
+        Inbox(const Inbox &) = delete;
+        Inbox& operator=(const Inbox &) = delete;
+
+        ~Inbox()
+        {
+            drain([](T &&) {});
+        }
+
+        // returns true if the inbox was empty before, only then the consumer has to be woken up
+        bool push(T value)
+        {
+            auto node = new Node{std::move(value), nullptr};
+            Node *first = head.load(std::memory_order_relaxed);
+            do
+                node->next = first;
+            while (!head.compare_exchange_weak(first, node, std::memory_order_release, std::memory_order_relaxed));
+            // not node->next, the consumer may own the node already
+            return first == nullptr;
+        }
+
+        // calls f on every message pushed so far, only one thread may drain
+        template<typename F>
+        void drain(F &&f)
+        {
+            Node *node = head.exchange(nullptr, std::memory_order_acquire);
+            Node *fifo = nullptr;
+            while (node)
+            {
+                Node *next = node->next;
+                node->next = fifo;
+                fifo = node;
+                node = next;
+            }
+            while (fifo)
+            {
+                std::unique_ptr<Node> current(fifo);
+                fifo = fifo->next;
+                f(std::move(current->value));
+            }
+        }
+
+    private:
+        struct Node
+        {
+            T value;
+            Node *next;
+        };
+
+        std::atomic<Node *> head;
+    };
+}
+
+#endif
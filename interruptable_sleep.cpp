@@ -1,31 +1,150 @@
+#include <cerrno>
+#include <cstdint>
+#include <system_error>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
 #include "interruptable_sleep.hpp"
 
-secman::InterruptableSleep::InterruptableSleep() : interrupted(false) {}
+namespace
+{
+    [[noreturn]] void throw_errno(const char *what)
+    {
+        throw std::system_error(errno, std::generic_category(), what);
+    }
+
+    void add_to_epoll(int epoll_fd, int fd)
+    {
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.fd = fd;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1)
+            throw_errno("epoll_ctl");
+    }
+
+    void arm(int timer_fd, std::chrono::system_clock::time_point time)
+    {
+        auto since_epoch = time.time_since_epoch();
+        auto seconds = std::chrono::duration_cast<std::chrono::seconds>(since_epoch);
+        itimerspec spec{};
+        spec.it_value.tv_sec = seconds.count();
+        spec.it_value.tv_nsec = std::chrono::duration_cast<std::chrono::nanoseconds>(since_epoch - seconds).count();
+        // an all zero value would disarm the timer instead
+        if (spec.it_value.tv_sec <= 0 && spec.it_value.tv_nsec <= 0)
+            spec.it_value.tv_nsec = 1;
+        if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, nullptr) == -1)
+            throw_errno("timerfd_settime");
+    }
+
+    void disarm(int timer_fd)
+    {
+        itimerspec spec{};
+        timerfd_settime(timer_fd, 0, &spec, nullptr);
+    }
+
+    // both fds are non-blocking, reading resets them
+    void drain(int fd)
+    {
+        std::uint64_t value;
+        while (read(fd, &value, sizeof(value)) == sizeof(value));
+    }
+}
+
+secman::InterruptableSleep::InterruptableSleep()
+{
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1)
+        throw_errno("epoll_create1");
+    // the wake up times are system_clock time points
+    timer_fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd == -1)
+        throw_errno("timerfd_create");
+    event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event_fd == -1)
+        throw_errno("eventfd");
+    add_to_epoll(epoll_fd, timer_fd);
+    add_to_epoll(epoll_fd, event_fd);
+}
+
+secman::InterruptableSleep::~InterruptableSleep() noexcept
+{
+    close(event_fd);
+    close(timer_fd);
+    close(epoll_fd);
+}
 
 void secman::InterruptableSleep::sleep_for(std::chrono::system_clock::duration duration)
 {
-    std::unique_lock<std::mutex> ul(m);
-    cv.wait_for(ul, duration, [this] { return interrupted; });
-    interrupted = false;
+    sleep_until(std::chrono::system_clock::now() + duration);
 }
 
 void secman::InterruptableSleep::sleep_until(std::chrono::system_clock::time_point time)
 {
-    std::unique_lock<std::mutex> ul(m);
-    cv.wait_until(ul, time, [this] { return interrupted; });
-    interrupted = false;
+    arm(timer_fd, time);
+    wait();
 }
 
 void secman::InterruptableSleep::sleep()
 {
-    std::unique_lock<std::mutex> ul(m);
-    cv.wait(ul, [this] { return interrupted; });
-    interrupted = false;
+    disarm(timer_fd);
+    wait();
 }
 
 void secman::InterruptableSleep::interrupt()
+{
+    std::uint64_t one = 1;
+    if (write(event_fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+        throw_errno("eventfd write");
+}
+
+void secman::InterruptableSleep::watch(int fd, std::function<void()> on_ready)
 {
     std::lock_guard<std::mutex> lg(m);
-    interrupted = true;
-    cv.notify_one();
-}
\ No newline at end of file
+    add_to_epoll(epoll_fd, fd);
+    watchers[fd] = std::make_shared<std::function<void()>>(std::move(on_ready));
+}
+
+void secman::InterruptableSleep::unwatch(int fd)
+{
+    std::lock_guard<std::mutex> lg(m);
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+    watchers.erase(fd);
+}
+
+void secman::InterruptableSleep::wait()
+{
+    epoll_event events[16];
+    bool woken = false;
+    while (!woken)
+    {
+        int n = epoll_wait(epoll_fd, events, 16, -1);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            throw_errno("epoll_wait");
+        }
+        for (int i = 0; i < n; ++i)
+        {
+            int fd = events[i].data.fd;
+            if (fd == timer_fd || fd == event_fd)
+            {
+                woken = true;
+                continue;
+            }
+            std::shared_ptr<std::function<void()>> on_ready;
+            {
+                std::lock_guard<std::mutex> lg(m);
+                auto watcher = watchers.find(fd);
+                if (watcher != watchers.end())
+                    on_ready = watcher->second;
+            }
+            if (on_ready)
+                (*on_ready)();
+        }
+    }
+    // like the flag of a condition variable based sleep, a pending interrupt is used up by this sleep
+    drain(timer_fd);
+    drain(event_fd);
+}
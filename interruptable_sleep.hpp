@@ -2,10 +2,10 @@
 #define SECMAN_INTERRUPTABLE_SLEEP_H
 
 #include <chrono>
-#include <thread>
-#include <future>
+#include <functional>
+#include <memory>
 #include <mutex>
-#include <sstream>
+#include <unordered_map>
 
 namespace secman
 {
@@ -16,12 +16,16 @@ namespace secman
         // and be interrupted before any sleep is called (the sleep will immediately complete)
         // Has same interface as condition_variables and futures, except with sleep instead of wait.
         // For a given object, sleep can be called on multiple threads safely, but is not recommended as behaviour is undefined.
+        //
+        // Built on epoll: a timerfd armed at the wake up time and an eventfd for interrupt().
+        // Other file descriptors can be watched too, their callbacks run on the sleeping thread
+        // and the sleep goes on afterwards.
 
     public:
         InterruptableSleep();
         InterruptableSleep(const InterruptableSleep &) = delete;
         InterruptableSleep(InterruptableSleep &&) noexcept = delete;
-        ~InterruptableSleep() noexcept = default;
+        ~InterruptableSleep() noexcept;
         InterruptableSleep& operator=(const InterruptableSleep &) noexcept = delete;
         InterruptableSleep& operator=(InterruptableSleep &&) noexcept = delete;
 
@@ -30,11 +34,22 @@ namespace secman
         void sleep();
         void interrupt();
 
+        // on_ready is called from the sleeping thread each time fd becomes readable
+        // the caller keeps ownership of fd and has to unwatch it before closing it
+        void watch(int fd, std::function<void()> on_ready);
+        void unwatch(int fd);
+
     private:
-        bool interrupted;
+        int epoll_fd;
+        int timer_fd;
+        int event_fd;
+
         std::mutex m;
-        std::condition_variable cv;
+        std::unordered_map<int, std::shared_ptr<std::function<void()>>> watchers;
+
+        // runs the loop until the timer fires or the sleep is interrupted
+        void wait();
     };
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,89 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <system_error>
+#include <fcntl.h>
+#include <unistd.h>
+#include "job_log.hpp"
+
+namespace
+{
+    // the most one drain moves, so a chatty job doesn't keep the supervisor from its other fds for long
+    constexpr std::size_t max_chunk = 1 << 20;
+}
+
+secman::JobLog::JobLog(std::string path, std::size_t max_size, int keep)
+        : file_path(std::move(path)), max_size(max_size), keep(keep), fd(-1), size(0) {}
+
+secman::JobLog::~JobLog()
+{
+    if (fd != -1)
+        close();
+}
+
+bool secman::JobLog::drain(int pipe_fd)
+{
+    std::size_t moved = 0;
+    while (moved < max_chunk)
+    {
+        if (fd == -1)
+            open();
+        if (static_cast<std::size_t>(size) >= max_size)
+        {
+            rotate();
+            continue;
+        }
+        auto room = std::min(max_size - static_cast<std::size_t>(size), max_chunk - moved);
+        // an explicit offset because splice refuses files opened with O_APPEND
+        ssize_t n = splice(pipe_fd, nullptr, fd, &size, room, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0)
+        {
+            moved += static_cast<std::size_t>(n);  // splice advanced size
+            continue;
+        }
+        if (n == -1 && errno == EINTR)
+            continue;
+        // EAGAIN: the pipe is empty for now
+        if (n == -1 && errno == EAGAIN)
+            return true;
+        // end of file, or the file system can't take spliced data. the next run opens the file again,
+        // so jobs that aren't writing don't hold an fd each
+        close();
+        return false;
+    }
+    // the rest is left for the next time the pipe is reported readable, the other fds go first
+    return true;
+}
+
+const std::string &secman::JobLog::path() const
+{
+    return file_path;
+}
+
+void secman::JobLog::open()
+{
+    fd = ::open(file_path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1)
+        throw std::system_error(errno, std::generic_category(), "open " + file_path);
+    size = lseek(fd, 0, SEEK_END);
+}
+
+void secman::JobLog::close()
+{
+    ::close(fd);
+    fd = -1;
+}
+
+void secman::JobLog::rotate()
+{
+    close();
+    if (keep <= 0)
+    {
+        // nothing is kept, start over in the same file
+        ::truncate(file_path.c_str(), 0);
+        return;
+    }
+    for (int i = keep - 1; i >= 1; --i)
+        std::rename((file_path + '.' + std::to_string(i)).c_str(), (file_path + '.' + std::to_string(i + 1)).c_str());
+    std::rename(file_path.c_str(), (file_path + ".1").c_str());
+}
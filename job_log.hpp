@@ -0,0 +1,43 @@
+#ifndef SECMAN_JOB_LOG_H
+#define SECMAN_JOB_LOG_H
+
+#include <cstddef>
+#include <string>
+#include <sys/types.h>
+
+namespace secman
+{
+    // size capped log file of a job, rotated like logrotate: path, path.1, ..., path.<keep>
+    // the output of the job arrives in a pipe and is spliced into the file, it never goes through a user space buffer
+    // a log is not thread safe, the supervisor uses it from its thread only
+    class JobLog
+    {
+    public:
+        JobLog(std::string path, std::size_t max_size, int keep);
+        JobLog(const JobLog &) = delete;
+        JobLog& operator=(const JobLog &) = delete;
+        ~JobLog();
+
+        // moves what can be read from the non-blocking pipe into the log, at most 1 MiB at a time
+        // returns false once the pipe is at end of file or can't be spliced from any more, the file is closed then
+        // and opened again by the next drain, so a log only holds an fd while output of its job is coming in
+        bool drain(int pipe_fd);
+
+        const std::string &path() const;
+
+    private:
+        std::string file_path;
+        std::size_t max_size;
+        int keep;
+
+        int fd;
+        off_t size;
+
+        void open();
+        void close();
+        // renames the files one generation up and starts a new one, only metadata changes
+        void rotate();
+    };
+}
+
+#endif
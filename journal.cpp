@@ -0,0 +1,316 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "journal.hpp"
+
+namespace
+{
+    constexpr char magic[8] = {'s', 'e', 'c', 'm', 'a', 'n', 'j', '1'};
+    constexpr std::size_t initial_capacity = 1 << 20;
+
+    struct Header
+    {
+        char magic[8];
+        std::uint64_t end;  // offset after the last complete record
+    };
+
+    // fields ordered so there is no padding, the command follows and the whole is padded to 8 bytes
+    struct Record
+    {
+        std::uint32_t size;
+        std::uint32_t command_size;
+        std::uint64_t id;
+        std::int64_t next;
+        std::uint64_t minutes;
+        std::uint32_t hours;
+        std::uint32_t days;
+        std::uint16_t months;
+        std::uint8_t days_of_week;
+        std::uint8_t kind;
+        std::uint8_t any_day;
+        std::uint8_t any_day_of_week;
+        std::uint8_t overlap;
+        std::uint8_t group_size;  // the group name follows the command
+        // then a 32 bit jitter in milliseconds and a 32 bit priority,
+        // read as 0 from older records that have zero padding or no room there
+    };
+    static_assert(sizeof(Record) == 48, "the record layout is part of the file format");
+
+    // a record that only ends the life of a job
+    constexpr std::uint8_t remove_kind = 0xff;
+
+    [[noreturn]] void throw_errno(const std::string &what)
+    {
+        throw std::system_error(errno, std::generic_category(), what);
+    }
+
+    Header &header_of(char *data)
+    {
+        return *reinterpret_cast<Header *>(data);
+    }
+}
+
+secman::Journal::Journal(std::string path) : path(std::move(path)), dead(0)
+{
+    journal.fd = open(this->path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (journal.fd == -1)
+        throw_errno("open " + this->path);
+    struct stat st{};
+    fstat(journal.fd, &st);
+    bool fresh = static_cast<std::size_t>(st.st_size) < sizeof(Header);
+    journal.capacity = fresh ? initial_capacity : static_cast<std::size_t>(st.st_size);
+    if (fresh && ftruncate(journal.fd, static_cast<off_t>(journal.capacity)) == -1)
+        throw_errno("ftruncate " + this->path);
+    void *data = mmap(nullptr, journal.capacity, PROT_READ | PROT_WRITE, MAP_SHARED, journal.fd, 0);
+    if (data == MAP_FAILED)
+        throw_errno("mmap " + this->path);
+    journal.data = static_cast<char *>(data);
+    if (fresh)
+    {
+        std::memcpy(header_of(journal.data).magic, magic, sizeof(magic));
+        header_of(journal.data).end = sizeof(Header);
+    }
+    else if (std::memcmp(header_of(journal.data).magic, magic, sizeof(magic)) != 0)
+        throw std::runtime_error("not a secman journal: " + this->path);
+
+    // the snapshot is optional and never changes once written
+    auto snapshot_path = this->path + ".snapshot";
+    snapshot.fd = open(snapshot_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (snapshot.fd != -1)
+    {
+        fstat(snapshot.fd, &st);
+        snapshot.capacity = static_cast<std::size_t>(st.st_size);
+        data = mmap(nullptr, snapshot.capacity, PROT_READ, MAP_SHARED, snapshot.fd, 0);
+        if (data == MAP_FAILED)
+            throw_errno("mmap " + snapshot_path);
+        snapshot.data = static_cast<char *>(data);
+        if (snapshot.capacity < sizeof(Header) || std::memcmp(header_of(snapshot.data).magic, magic, sizeof(magic)) != 0)
+            throw std::runtime_error("not a secman snapshot: " + snapshot_path);
+        scan(snapshot, true);
+    }
+    scan(journal, false);
+}
+
+secman::Journal::~Journal()
+{
+    for (auto file : {&journal, &snapshot})
+    {
+        if (file->data)
+            munmap(file->data, file->capacity);
+        if (file->fd != -1)
+            close(file->fd);
+    }
+}
+
+std::vector<secman::Journal::Job> secman::Journal::load() const
+{
+    std::lock_guard<std::mutex> lg(m);
+    std::vector<Job> jobs;
+    jobs.reserve(live.size());
+    for (auto &i : live)
+    {
+        auto record = reinterpret_cast<const Record *>(record_at(i.second));
+        Job job{record->id, static_cast<Kind>(record->kind),
+                std::chrono::system_clock::time_point(std::chrono::system_clock::duration(record->next)),
+                Cron(), std::string(reinterpret_cast<const char *>(record + 1), record->command_size),
+                record->overlap,
+                std::string(reinterpret_cast<const char *>(record + 1) + record->command_size, record->group_size)};
+        job.cron.minutes = record->minutes;
+        job.cron.hours = record->hours;
+        job.cron.days = record->days;
+        job.cron.months = record->months;
+        job.cron.days_of_week = record->days_of_week;
+        job.cron.any_day = record->any_day;
+        job.cron.any_day_of_week = record->any_day_of_week;
+        auto jitter_at = sizeof(Record) + record->command_size + record->group_size;
+        if (record->size >= jitter_at + sizeof(job.jitter))
+            std::memcpy(&job.jitter, reinterpret_cast<const char *>(record) + jitter_at, sizeof(job.jitter));
+        auto priority_at = jitter_at + sizeof(job.jitter);
+        if (record->size >= priority_at + sizeof(job.priority))
+            std::memcpy(&job.priority, reinterpret_cast<const char *>(record) + priority_at, sizeof(job.priority));
+        jobs.push_back(std::move(job));
+    }
+    return jobs;
+}
+
+void secman::Journal::add(const Job &job)
+{
+    if (job.group.size() > max_group_size)
+        throw std::invalid_argument("group name too long: " + job.group);
+    auto jitter_at = sizeof(Record) + job.command.size() + job.group.size();
+    auto priority_at = jitter_at + sizeof(job.jitter);
+    std::vector<char> buffer((priority_at + sizeof(job.priority) + 7) / 8 * 8, 0);
+    auto record = reinterpret_cast<Record *>(buffer.data());
+    record->size = static_cast<std::uint32_t>(buffer.size());
+    record->command_size = static_cast<std::uint32_t>(job.command.size());
+    record->id = job.id;
+    record->next = job.next.time_since_epoch().count();
+    record->minutes = job.cron.minutes;
+    record->hours = job.cron.hours;
+    record->days = job.cron.days;
+    record->months = job.cron.months;
+    record->days_of_week = job.cron.days_of_week;
+    record->kind = static_cast<std::uint8_t>(job.kind);
+    record->any_day = job.cron.any_day;
+    record->any_day_of_week = job.cron.any_day_of_week;
+    record->overlap = job.overlap;
+    record->group_size = static_cast<std::uint8_t>(job.group.size());
+    std::memcpy(record + 1, job.command.data(), job.command.size());
+    std::memcpy(reinterpret_cast<char *>(record + 1) + job.command.size(), job.group.data(), job.group.size());
+    std::memcpy(buffer.data() + jitter_at, &job.jitter, sizeof(job.jitter));
+    std::memcpy(buffer.data() + priority_at, &job.priority, sizeof(job.priority));
+
+    std::lock_guard<std::mutex> lg(m);
+    auto offset = header_of(journal.data).end;
+    append(buffer.data(), buffer.size());
+    auto i = live.find(job.id);
+    if (i != live.end())
+    {
+        ++dead;
+        i->second = Location{false, offset};
+        compact_if_dead();
+    }
+    else
+        live.emplace(job.id, Location{false, offset});
+}
+
+void secman::Journal::remove(std::uint64_t id)
+{
+    std::lock_guard<std::mutex> lg(m);
+    auto i = live.find(id);
+    if (i == live.end())
+        return;
+    live.erase(i);
+    Record record{};
+    record.size = sizeof(Record);
+    record.id = id;
+    record.kind = remove_kind;
+    append(reinterpret_cast<const char *>(&record), sizeof(record));
+    dead += 2;
+    compact_if_dead();
+}
+
+void secman::Journal::compact_if_dead()
+{
+    // the snapshot is rewritten once it and the journal are mostly dead records
+    if (dead > live.size() && dead > 1024)
+        rewrite_snapshot();
+}
+
+void secman::Journal::compact()
+{
+    std::lock_guard<std::mutex> lg(m);
+    rewrite_snapshot();
+}
+
+void secman::Journal::rewrite_snapshot()
+{
+    std::size_t size = sizeof(Header);
+    for (auto &i : live)
+        size += reinterpret_cast<const Record *>(record_at(i.second))->size;
+
+    auto snapshot_path = path + ".snapshot";
+    auto temporary_path = snapshot_path + ".tmp";
+    int fd = open(temporary_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1)
+        throw_errno("open " + temporary_path);
+    if (ftruncate(fd, static_cast<off_t>(size)) == -1)
+        throw_errno("ftruncate " + temporary_path);
+    void *data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED)
+        throw_errno("mmap " + temporary_path);
+    auto out = static_cast<char *>(data);
+    std::memcpy(header_of(out).magic, magic, sizeof(magic));
+    header_of(out).end = size;
+    std::size_t offset = sizeof(Header);
+    for (auto &i : live)
+    {
+        auto record = record_at(i.second);
+        auto record_size = reinterpret_cast<const Record *>(record)->size;
+        std::memcpy(out + offset, record, record_size);
+        i.second = Location{true, offset};
+        offset += record_size;
+    }
+    // the snapshot has to be on disk before the journal that it replaces is emptied
+    msync(out, size, MS_SYNC);
+    if (std::rename(temporary_path.c_str(), snapshot_path.c_str()) == -1)
+        throw_errno("rename " + temporary_path);
+
+    if (snapshot.data)
+        munmap(snapshot.data, snapshot.capacity);
+    if (snapshot.fd != -1)
+        close(snapshot.fd);
+    snapshot.fd = fd;
+    snapshot.data = out;
+    snapshot.capacity = size;
+
+    header_of(journal.data).end = sizeof(Header);
+    dead = 0;
+}
+
+std::size_t secman::Journal::size() const
+{
+    std::lock_guard<std::mutex> lg(m);
+    return live.size();
+}
+
+void secman::Journal::append(const char *record, std::size_t size)
+{
+    auto end = header_of(journal.data).end;
+    if (end + size > journal.capacity)
+    {
+        auto capacity = std::max(journal.capacity * 2, end + size);
+        if (ftruncate(journal.fd, static_cast<off_t>(capacity)) == -1)
+            throw_errno("ftruncate " + path);
+        void *data = mremap(journal.data, journal.capacity, capacity, MREMAP_MAYMOVE);
+        if (data == MAP_FAILED)
+            throw_errno("mremap " + path);
+        journal.data = static_cast<char *>(data);
+        journal.capacity = capacity;
+    }
+    std::memcpy(journal.data + end, record, size);
+    // the record only counts once it is complete
+    header_of(journal.data).end = end + size;
+}
+
+void secman::Journal::scan(const Mapping &file, bool is_snapshot)
+{
+    std::size_t end = std::min<std::size_t>(header_of(file.data).end, file.capacity);
+    std::size_t offset = sizeof(Header);
+    while (offset + sizeof(Record) <= end)
+    {
+        auto record = reinterpret_cast<const Record *>(file.data + offset);
+        if (record->size < sizeof(Record) + record->command_size + record->group_size || offset + record->size > end)
+            break;  // a torn tail
+        if (record->kind == remove_kind)
+        {
+            if (live.erase(record->id))
+                ++dead;
+            ++dead;
+        }
+        else
+        {
+            auto i = live.find(record->id);
+            if (i != live.end())
+            {
+                ++dead;
+                i->second = Location{is_snapshot, offset};
+            }
+            else
+                live.emplace(record->id, Location{is_snapshot, offset});
+        }
+        offset += record->size;
+    }
+}
+
+const char *secman::Journal::record_at(const Location &location) const
+{
+    return (location.in_snapshot ? snapshot.data : journal.data) + location.offset;
+}
@@ -0,0 +1,94 @@
+#ifndef SECMAN_JOURNAL_H
+#define SECMAN_JOURNAL_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "cron.hpp"
+
+namespace secman
+{
+    // persistent store of the command jobs, so they survive a restart
+    // changes are appended as fixed layout records to a memory mapped journal file,
+    // compaction writes the live jobs to a snapshot (path + ".snapshot") and empties the journal.
+    // cron jobs are stored with their compiled masks, so nothing is parsed again on startup.
+    // the journal is not synced on every change, a crash of secman loses nothing, a crash of the host may lose the tail
+    class Journal
+    {
+    public:
+        enum class Kind : std::uint8_t { at = 1, cron = 2 };
+
+        struct Job
+        {
+            std::uint64_t id;  // the scheduler's TaskId
+            Kind kind;
+            std::chrono::system_clock::time_point next;  // time of an at job
+            Cron cron;                                   // masks of a cron job
+            std::string command;
+            std::uint8_t overlap = 0;  // the scheduler's Overlap
+            std::string group{};       // at most max_group_size bytes
+            std::uint32_t jitter = 0;  // milliseconds
+            std::int32_t priority = 0;
+        };
+
+        static constexpr std::size_t max_group_size = 255;
+
+        explicit Journal(std::string path);
+        Journal(const Journal &) = delete;
+        Journal& operator=(const Journal &) = delete;
+        ~Journal();
+
+        // the jobs saved so far, read straight from the mapped files
+        std::vector<Job> load() const;
+
+        // a job whose id is saved already replaces it
+        void add(const Job &job);
+        // no-op for an unknown id
+        void remove(std::uint64_t id);
+
+        // done by add and remove on their own once most of the journal is dead records
+        void compact();
+
+        std::size_t size() const;
+
+    private:
+        struct Mapping
+        {
+            int fd = -1;
+            char *data = nullptr;
+            std::size_t capacity = 0;
+        };
+
+        // where the live record of a job is
+        struct Location
+        {
+            bool in_snapshot;
+            std::size_t offset;
+        };
+
+        std::string path;
+        Mapping journal;
+        Mapping snapshot;
+        std::unordered_map<std::uint64_t, Location> live;
+        // records in the journal that a compaction would drop
+        std::size_t dead;
+
+        mutable std::mutex m;
+
+        void append(const char *record, std::size_t size);
+        // compact with m held
+        void rewrite_snapshot();
+        // rewrite_snapshot once most records are dead, with m held
+        void compact_if_dead();
+        // indexes the records of a mapped file into live
+        void scan(const Mapping &file, bool is_snapshot);
+        const char *record_at(const Location &location) const;
+    };
+}
+
+#endif
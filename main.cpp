@@ -1,20 +1,41 @@
 #include <chrono>
 #include "argparse.hpp"
 #include "scheduler.hpp"
+#include "control.hpp"
+#include "daemon.hpp"
+#include "crontab.hpp"
 #include <memory>
 #include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include <unistd.h>
+#include <map>
 
 using namespace std;
 
-void exec(const string &expression)
+// the flags without inputs, argparse doesn't count those
+bool has_flag(int argc, const char** argv, const char *flag)
 {
-    system(expression.c_str());
+    for (int i = 1; i < argc; ++i)
+        if (strcmp(argv[i], flag) == 0)
+            return true;
+    return false;
 }
 
-int main(int argc, const char** argv)
+string join(const vector<string> &words)
 {
-    secman::Scheduler s(12);
+    string joined;
+    for (auto &i : words)
+    {
+        if (!joined.empty())
+            joined += ' ';
+        joined += i;
+    }
+    return joined;
+}
 
+int main(int argc, const char** argv)
+{
     // make a new ArgumentParser
     ArgumentParser parser;
     parser.appName("secman");
@@ -27,74 +48,236 @@ int main(int argc, const char** argv)
     parser.addArgument("-e", "--execute", '+', true);
     parser.addArgument("-l", "--list", true);
     parser.addArgument("-d", "--delete", 1, true);
+    parser.addArgument("-s", "--stats", 0, true);
+    parser.addArgument("-D", "--daemon", 0, true);
+    parser.addArgument("-S", "--socket", 1, true);
+    parser.addArgument("-o", "--log-dir", 1, true);
+    parser.addArgument("-j", "--journal", 1, true);
+    parser.addArgument("-L", "--load", 1, true);
+    parser.addArgument("-W", "--watch", '+', true);
+    parser.addArgument("-O", "--overlap", 1, true);
+    parser.addArgument("-g", "--group", 1, true);
+    parser.addArgument("-G", "--group-limit", '+', true);
+    parser.addArgument("-J", "--jitter", 1, true);
+    parser.addArgument("-r", "--start-rate", 1, true);
+    parser.addArgument("-R", "--group-rate", '+', true);
+    parser.addArgument("-k", "--slack", 1, true);
+    parser.addArgument("-p", "--priority", 1, true);
+    parser.addArgument("-w", "--group-weight", '+', true);
+    parser.addArgument("-t", "--threads", 1, true);
+    parser.addArgument("-m", "--max-threads", 1, true);
+    parser.addArgument("-C", "--cpus", 1, true);
+    parser.addArgument("-N", "--numa", 0, true);
+    parser.addArgument("-P", "--dispatcher-cpu", 1, true);
+    parser.addArgument("-M", "--metrics", 1, true);
+    parser.addArgument("-T", "--task-latency", 0, true);
 
 
     // parse the command-line arguments - throws if invalid format
     parser.parse(argc, argv);
 
+    string socket_path = parser.count("socket") ? parser.retrieve<string>("socket") : secman::default_socket_path();
 
-
-    if (parser.count("at"))
+    // secman --daemon [--journal PATH] [--log-dir DIR] [--load FILE] [--watch PATH...] runs the scheduler,
+    // the other flags talk to it
+    if (has_flag(argc, argv, "--daemon") || has_flag(argc, argv, "-D"))
     {
-        if(parser.count("execute"))
-        {
-            vector<string> command = parser.retrieve<vector<string>>("execute");
-
-            string command_parse;
-
-            for (auto &i : command)
+        secman::Daemon::Options options;
+        options.socket_path = socket_path;
+        if (parser.count("journal"))
+            options.journal_path = parser.retrieve<string>("journal");
+        if (parser.count("log-dir"))
+            options.log_dir = parser.retrieve<string>("log-dir");
+        if (parser.count("load"))
+            options.load_path = parser.retrieve<string>("load");
+        if (parser.count("watch"))
+            options.watch_paths = parser.retrieve<vector<string>>("watch");
+        // --group-limit NAME=N...
+        if (parser.count("group-limit"))
+            for (auto &limit : parser.retrieve<vector<string>>("group-limit"))
             {
-                command_parse += i + ' ';
+                auto equals = limit.find('=');
+                if (equals == string::npos)
+                {
+                    cerr << "--group-limit takes NAME=N: " << limit << endl;
+                    return 1;
+                }
+                options.group_limits.emplace_back(limit.substr(0, equals), stoul(limit.substr(equals + 1)));
             }
-            command_parse.push_back('\0');
-
-            vector<string> at = parser.retrieve<vector<string>>("at");
-
-            string at_time;
-
-            for (auto &i : at)
+        // --group-weight NAME=WEIGHT...
+        if (parser.count("group-weight"))
+            for (auto &weight : parser.retrieve<vector<string>>("group-weight"))
+            {
+                auto equals = weight.find('=');
+                if (equals == string::npos)
+                {
+                    cerr << "--group-weight takes NAME=WEIGHT: " << weight << endl;
+                    return 1;
+                }
+                options.group_weights.emplace_back(weight.substr(0, equals), stoul(weight.substr(equals + 1)));
+            }
+        if (parser.count("start-rate"))
+            options.start_rate = stod(parser.retrieve<string>("start-rate"));
+        // --slack MILLISECONDS
+        if (parser.count("slack"))
+            options.slack = std::chrono::milliseconds(stoul(parser.retrieve<string>("slack")));
+        // --group-rate NAME=STARTS_PER_SECOND...
+        if (parser.count("group-rate"))
+            for (auto &rate : parser.retrieve<vector<string>>("group-rate"))
             {
-                at_time += i + ' ';
+                auto equals = rate.find('=');
+                if (equals == string::npos)
+                {
+                    cerr << "--group-rate takes NAME=STARTS_PER_SECOND: " << rate << endl;
+                    return 1;
+                }
+                options.group_rates.emplace_back(rate.substr(0, equals), stod(rate.substr(equals + 1)));
             }
-            at_time.erase(at_time.end() - 1);
-            at_time.push_back('\0');
-            auto command_c = new char[command_parse.size()];
-            std::copy(command_parse.begin(), command_parse.end(), command_c);
+        // --threads N, and --max-threads M to let the pool grow from N up to M under load
+        options.threads = parser.count("threads") ? stoul(parser.retrieve<string>("threads")) : 12;
+        if (parser.count("max-threads"))
+            options.max_threads = stoul(parser.retrieve<string>("max-threads"));
+        // --cpus LIST like 0-7,16 to keep the workers on, --numa to spread them over the NUMA nodes
+        // with a queue per node, --dispatcher-cpu N to give the dispatcher a core of its own
+        if (parser.count("cpus"))
+            options.placement.cpus = tp::parse_cpu_list(parser.retrieve<string>("cpus"));
+        options.placement.per_node = has_flag(argc, argv, "--numa") || has_flag(argc, argv, "-N");
+        if (parser.count("dispatcher-cpu"))
+            options.placement.reserved_cpu = stoi(parser.retrieve<string>("dispatcher-cpu"));
+        // --metrics FILE to write the stats there for Prometheus, --task-latency to add the latencies of each job
+        if (parser.count("metrics"))
+            options.metrics_path = parser.retrieve<string>("metrics");
+        options.task_latency = has_flag(argc, argv, "--task-latency") || has_flag(argc, argv, "-T");
+        secman::Daemon daemon(options);
+        daemon.run();
+        return 0;
+    }
 
-            auto at_time_c = new char[at_time.size()];
-            std::copy(at_time.begin(), at_time.end(), at_time_c);
+    // everything asked for goes to the daemon in one round trip
+    vector<secman::ControlRequest> requests;
 
-            cout << at_time_c << endl << command_c << endl;
-            s.at(at_time_c, system, command_c);
+    // --overlap allow|skip|queue|replace, --group NAME, --jitter SECONDS and --priority N
+    // apply to the job added with --at or --cron
+    uint8_t overlap = 0;
+    if (parser.count("overlap"))
+    {
+        static const char *overlaps[] = {"allow", "skip", "queue", "replace"};
+        string name = parser.retrieve<string>("overlap");
+        auto found = find(begin(overlaps), end(overlaps), name);
+        if (found == end(overlaps))
+        {
+            cerr << "unknown --overlap " << name << ", one of allow, skip, queue, replace" << endl;
+            return 1;
         }
+        overlap = static_cast<uint8_t>(found - begin(overlaps));
     }
+    string group = parser.count("group") ? parser.retrieve<string>("group") : string();
+    auto priority = parser.count("priority") ? stoi(parser.retrieve<string>("priority")) : 0;
+    auto jitter = parser.count("jitter") ? static_cast<uint32_t>(stod(parser.retrieve<string>("jitter")) * 1000) : 0;
 
-    if (parser.count("cron"))
+    if (parser.count("at") && parser.count("execute"))
     {
-        if(parser.count("execute"))
-        {
-            vector<string> command = parser.retrieve<vector<string>>("execute");
+        secman::ControlRequest request{secman::ControlRequest::Type::add_at};
+        request.time = secman::parse_time(join(parser.retrieve<vector<string>>("at"))).time_since_epoch().count();
+        request.command = join(parser.retrieve<vector<string>>("execute"));
+        request.overlap = overlap;
+        request.group = group;
+        request.jitter = jitter;
+        request.priority = priority;
+        requests.push_back(request);
+    }
 
-            string command_parse;
+    if (parser.count("cron") && parser.count("execute"))
+    {
+        secman::ControlRequest request{secman::ControlRequest::Type::add_cron};
+        request.expression = join(parser.retrieve<vector<string>>("cron"));
+        request.command = join(parser.retrieve<vector<string>>("execute"));
+        request.overlap = overlap;
+        request.group = group;
+        request.jitter = jitter;
+        request.priority = priority;
+        requests.push_back(request);
+    }
 
-            for (auto &i : command)
-            {
-                command_parse += i + ' ';
-            }
-            vector<string> cron = parser.retrieve<vector<string>>("cron");
+    if (parser.count("delete"))
+    {
+        secman::ControlRequest request{secman::ControlRequest::Type::remove};
+        request.id = stoull(parser.retrieve<string>("delete"));
+        requests.push_back(request);
+    }
 
-            string cron_time;
+    // --list all or --list <id>
+    if (parser.count("list"))
+    {
+        string which = parser.retrieve<string>("list");
+        secman::ControlRequest request{secman::ControlRequest::Type::list};
+        request.id = which == "all" ? 0 : stoull(which);
+        requests.push_back(request);
+    }
 
-            cron_time = cron[0] + ' ' + cron[1] + ' ' + cron[2] + ' ' + cron[3] + ' ' + cron[4] + '\0';
+    // --load FILE, or --load - for a crontab on stdin
+    // the daemon reads a file itself, so its path has to make sense there
+    if (parser.count("load"))
+    {
+        string path = parser.retrieve<string>("load");
+        secman::ControlRequest request{secman::ControlRequest::Type::load};
+        if (path == "-")
+            request.text = string(secman::InputFile(STDIN_FILENO).view());
+        else
+        {
+            unique_ptr<char, decltype(&free)> absolute(realpath(path.c_str(), nullptr), &free);
+            if (!absolute)
+            {
+                cerr << path << ": " << strerror(errno) << endl;
+                return 1;
+            }
+            request.path = absolute.get();
+        }
+        requests.push_back(request);
+    }
 
-            auto command_c = new char[command_parse.size()];
-            std::copy(command_parse.begin(), command_parse.end(), command_c);
+    if (has_flag(argc, argv, "--stats") || has_flag(argc, argv, "-s"))
+        requests.push_back(secman::ControlRequest{secman::ControlRequest::Type::stats});
 
-            auto cron_time_c = new char[cron_time.size()];
-            std::copy(cron_time.begin(), cron_time.end(), cron_time_c);
+    if (requests.empty())
+        return 0;
 
-            cout << cron_time_c << endl << command_c << endl;
-            s.cron(cron_time_c, system, command_c);
+    secman::ControlClient client(socket_path);
+    int status = 0;
+    for (auto &response : client.call(requests))
+    {
+        switch (response.type)
+        {
+            case secman::ControlResponse::Type::id:
+                cout << "id " << response.id << endl;
+                break;
+            case secman::ControlResponse::Type::ok:
+                break;
+            case secman::ControlResponse::Type::error:
+                cerr << response.error << endl;
+                status = 1;
+                break;
+            case secman::ControlResponse::Type::list:
+                for (auto &entry : response.entries)
+                {
+                    cout << entry.id << '\t';
+                    if (!entry.running)
+                    {
+                        auto next = chrono::system_clock::to_time_t(
+                                chrono::system_clock::time_point(chrono::system_clock::duration(entry.next)));
+                        cout << put_time(localtime(&next), "%Y-%m-%d %H:%M:%S");
+                    }
+                    else
+                        cout << "running";
+                    cout << '\t' << entry.command << endl;
+                }
+                break;
+            case secman::ControlResponse::Type::stats:
+                for (auto &stat : response.stats)
+                    cout << stat.first << '\t' << stat.second << endl;
+                // the lines a load rejected
+                cerr << response.error;
+                break;
         }
     }
 
@@ -130,9 +313,5 @@ int main(int argc, const char** argv)
 //        s.interval(std::chrono::seconds(15), system, command);
 //    }
 
-
-
-
-    std::this_thread::sleep_for(std::chrono::minutes(10));
-    return 0;
-}
\ No newline at end of file
+    return status;
+}
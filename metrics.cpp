@@ -0,0 +1,178 @@
+#include <cerrno>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <system_error>
+#include "metrics.hpp"
+
+namespace
+{
+    const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+    double seconds(std::chrono::nanoseconds d)
+    {
+        return std::chrono::duration<double>(d).count();
+    }
+
+    // label values are quoted, with \, " and newlines escaped
+    std::string escaped(const std::string &value)
+    {
+        std::string out;
+        for (auto c : value)
+        {
+            if (c == '\\' || c == '"')
+                out += '\\';
+            if (c == '\n')
+            {
+                out += "\\n";
+                continue;
+            }
+            out += c;
+        }
+        return out;
+    }
+
+    void header(std::ostream &out, const char *name, const char *type, const char *help)
+    {
+        out << "# HELP " << name << ' ' << help << '\n' << "# TYPE " << name << ' ' << type << '\n';
+    }
+
+    template<typename T>
+    void metric(std::ostream &out, const char *name, const char *type, const char *help, T value)
+    {
+        header(out, name, type, help);
+        out << name << ' ' << value << '\n';
+    }
+
+    // labels is empty or like task="1"
+    void summary(std::ostream &out, const std::string &name, const std::string &labels,
+                 const secman::HistogramSnapshot &histogram)
+    {
+        auto separator = labels.empty() ? "" : ",";
+        for (auto q : quantiles)
+            out << name << '{' << labels << separator << "quantile=\"" << q << "\"} "
+                << seconds(histogram.percentile(q)) << '\n';
+        auto braced = labels.empty() ? labels : '{' + labels + '}';
+        out << name << "_sum" << braced << ' ' << seconds(histogram.sum()) << '\n';
+        out << name << "_count" << braced << ' ' << histogram.count() << '\n';
+    }
+
+    struct Step
+    {
+        const char *name;
+        const char *help;
+        secman::HistogramSnapshot secman::LatencyStats::*histogram;
+    };
+
+    const Step steps[] = {
+            {"lateness_seconds", "from the time a run was due to the time it went to the pool", &secman::LatencyStats::lateness},
+            {"wait_seconds",     "time a run waited in the pool's queue",                        &secman::LatencyStats::wait},
+            {"duration_seconds", "time a job ran",                                               &secman::LatencyStats::run},
+    };
+}
+
+void secman::write_prometheus(std::ostream &out, Scheduler &scheduler)
+{
+    auto stats = scheduler.stats();
+    auto groups = scheduler.group_stats();
+    auto latency = scheduler.latency();
+    auto tasks = scheduler.task_latency();
+
+    metric(out, "secman_tasks", "gauge", "tasks scheduled or running", stats.tasks);
+    metric(out, "secman_timer_queued", "gauge", "tasks waiting in the timer queue", stats.queued);
+    metric(out, "secman_cron_tasks", "gauge", "cron tasks", stats.cron_tasks);
+    metric(out, "secman_cron_schedules", "gauge", "distinct schedules of the cron tasks", stats.cron_schedules);
+    metric(out, "secman_running", "gauge", "runs that have not ended", stats.running);
+    metric(out, "secman_skipped_total", "counter", "runs dropped by their overlap policy or group limit", stats.skipped);
+    metric(out, "secman_throttled", "gauge", "runs waiting for a start rate limit", stats.throttled);
+    metric(out, "secman_delayed", "gauge", "runs waiting out their jitter", stats.delayed);
+    metric(out, "secman_dispatcher_wakeups_total", "counter", "passes of the dispatcher", stats.wakeups);
+    metric(out, "secman_dispatcher_cpu_seconds_total", "counter", "cpu time of the dispatcher thread",
+           seconds(stats.dispatcher_cpu));
+    metric(out, "secman_pool_threads", "gauge", "threads of the pool", stats.threads);
+    metric(out, "secman_pool_idle_threads", "gauge", "idle threads of the pool", stats.idle_threads);
+    metric(out, "secman_pool_queued", "gauge", "runs waiting in the pool's queue", stats.pool_queued);
+    metric(out, "secman_pool_wakeups_total", "counter", "wake ups of idle threads of the pool", stats.pool_wakeups);
+
+    if (!groups.empty())
+    {
+        header(out, "secman_group_running", "gauge", "runs of the group that have not ended");
+        for (auto &group : groups)
+            out << "secman_group_running{group=\"" << escaped(group.name) << "\"} " << group.running << '\n';
+        header(out, "secman_group_queued", "gauge", "runs of the group in the pool's queue");
+        for (auto &group : groups)
+            out << "secman_group_queued{group=\"" << escaped(group.name) << "\"} " << group.queued << '\n';
+        header(out, "secman_group_started_total", "counter", "runs of the group the pool took");
+        for (auto &group : groups)
+            out << "secman_group_started_total{group=\"" << escaped(group.name) << "\"} " << group.started << '\n';
+    }
+
+    for (auto &step : steps)
+    {
+        auto name = std::string("secman_run_") + step.name;
+        header(out, name.c_str(), "summary", step.help);
+        summary(out, name, "", latency.*step.histogram);
+    }
+    if (!tasks.empty())
+        for (auto &step : steps)
+        {
+            auto name = std::string("secman_task_run_") + step.name;
+            header(out, name.c_str(), "summary", step.help);
+            for (auto &task : tasks)
+                summary(out, name, "task=\"" + std::to_string(task.first) + '"', task.second.*step.histogram);
+        }
+}
+
+void secman::dump_prometheus(const std::string &path, Scheduler &scheduler)
+{
+    auto temporary_path = path + ".tmp";
+    {
+        std::ofstream out(temporary_path, std::ios::trunc);
+        if (!out)
+            throw std::system_error(errno, std::generic_category(), "open " + temporary_path);
+        write_prometheus(out, scheduler);
+        out.flush();
+        if (!out)
+            throw std::system_error(errno, std::generic_category(), "write " + temporary_path);
+    }
+    if (std::rename(temporary_path.c_str(), path.c_str()) == -1)
+        throw std::system_error(errno, std::generic_category(), "rename " + temporary_path);
+}
+
+secman::MetricsFile::MetricsFile(std::string path, std::chrono::seconds interval, Scheduler &scheduler)
+        : path(std::move(path)), interval(interval), scheduler(scheduler), done(false)
+{
+    writer = std::thread(&MetricsFile::write_loop, this);
+}
+
+secman::MetricsFile::~MetricsFile()
+{
+    done = true;
+    sleeper.interrupt();
+    writer.join();
+}
+
+void secman::MetricsFile::write_loop()
+{
+    while (!done)
+    {
+        try
+        {
+            dump_prometheus(path, scheduler);
+        }
+        catch (const std::exception &e)
+        {
+            std::cerr << "metrics: " << e.what() << std::endl;
+        }
+        sleeper.sleep_for(interval);
+    }
+    // the counts up to the end
+    try
+    {
+        dump_prometheus(path, scheduler);
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "metrics: " << e.what() << std::endl;
+    }
+}
@@ -0,0 +1,46 @@
+#ifndef SECMAN_METRICS_H
+#define SECMAN_METRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <ostream>
+#include <string>
+#include <thread>
+
+#include "scheduler.hpp"
+#include "interruptable_sleep.hpp"
+
+namespace secman
+{
+    // the stats of the scheduler in the Prometheus text format, the latencies as summaries with their quantiles.
+    // the latencies of single tasks are only there for the tasks that record them, see Scheduler::record_task_latency.
+    // waits for the dispatcher like the other stats calls
+    void write_prometheus(std::ostream &out, Scheduler &scheduler);
+
+    // writes them to a temporary file next to path and renames it over path,
+    // so a reader like the textfile collector of node_exporter never sees half of it
+    void dump_prometheus(const std::string &path, Scheduler &scheduler);
+
+    // dumps the metrics to a file every interval from a thread of its own, and a last time when it is destroyed
+    class MetricsFile
+    {
+    public:
+        MetricsFile(std::string path, std::chrono::seconds interval, Scheduler &scheduler);
+        MetricsFile(const MetricsFile &) = delete;
+        MetricsFile& operator=(const MetricsFile &) = delete;
+        ~MetricsFile();
+
+    private:
+        std::string path;
+        std::chrono::seconds interval;
+        Scheduler &scheduler;
+
+        std::atomic<bool> done;
+        InterruptableSleep sleeper;
+        std::thread writer;
+
+        void write_loop();
+    };
+}
+
+#endif
@@ -0,0 +1,156 @@
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <system_error>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "process_runner.hpp"
+
+extern char **environ;
+
+namespace
+{
+    // characters that only the shell can make sense of
+    const char shell_syntax[] = "|&;<>()$`\\\"'*?[]#~{}!\n";
+
+    bool needs_shell(const std::string &command)
+    {
+        return command.find_first_of(shell_syntax) != std::string::npos;
+    }
+
+    std::vector<std::string> split(const std::string &command)
+    {
+        std::vector<std::string> words;
+        std::size_t end = 0;
+        while (true)
+        {
+            auto begin = command.find_first_not_of(" \t", end);
+            if (begin == std::string::npos)
+                break;
+            end = command.find_first_of(" \t", begin);
+            words.push_back(command.substr(begin, end == std::string::npos ? std::string::npos : end - begin));
+            if (end == std::string::npos)
+                break;
+        }
+        return words;
+    }
+
+    bool is_executable(const std::string &path)
+    {
+        struct stat st{};
+        return stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode) && access(path.c_str(), X_OK) == 0;
+    }
+
+    // the same lookup as execvp, empty if there is no such executable
+    std::string resolve(const std::string &name)
+    {
+        if (name.find('/') != std::string::npos)
+            return is_executable(name) ? name : std::string();
+        const char *path = std::getenv("PATH");
+        std::string dirs = path ? path : "/usr/local/bin:/usr/bin:/bin";
+        std::size_t begin = 0;
+        while (begin <= dirs.size())
+        {
+            auto end = dirs.find(':', begin);
+            if (end == std::string::npos)
+                end = dirs.size();
+            // an empty entry is the current directory
+            std::string dir = end == begin ? "." : dirs.substr(begin, end - begin);
+            auto candidate = dir + '/' + name;
+            if (is_executable(candidate))
+                return candidate;
+            begin = end + 1;
+        }
+        return std::string();
+    }
+}
+
+secman::ProcessRunner::Program::Program() : shell(false)
+{
+    posix_spawnattr_init(&attr);
+    sigset_t signals;
+    sigemptyset(&signals);
+    posix_spawnattr_setsigmask(&attr, &signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGQUIT);
+    sigaddset(&signals, SIGCHLD);
+    sigaddset(&signals, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &signals);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+}
+
+secman::ProcessRunner::Program::~Program()
+{
+    posix_spawnattr_destroy(&attr);
+}
+
+secman::ProcessRunner::ProcessRunner(const std::string &command)
+{
+    auto p = std::make_shared<Program>();
+    p->command = command;
+    if (!needs_shell(command))
+    {
+        p->args = split(command);
+        // a leading NAME=value is a variable assignment
+        if (!p->args.empty() && p->args[0].find('=') == std::string::npos)
+            p->path = resolve(p->args[0]);
+    }
+    if (p->path.empty())
+    {
+        p->shell = true;
+        p->path = "/bin/sh";
+        p->args = {"sh", "-c", command};
+    }
+    for (auto &arg : p->args)
+        p->argv.push_back(&arg[0]);
+    p->argv.push_back(nullptr);
+    program = std::move(p);
+}
+
+int secman::ProcessRunner::operator()() const
+{
+    pid_t pid = spawn();
+    int status;
+    while (waitpid(pid, &status, 0) == -1)
+    {
+        if (errno != EINTR)
+            throw std::system_error(errno, std::generic_category(), "waitpid");
+    }
+    return status;
+}
+
+pid_t secman::ProcessRunner::spawn() const
+{
+    return spawn(-1);
+}
+
+pid_t secman::ProcessRunner::spawn(int output_fd) const
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (output_fd != -1)
+    {
+        // dup2 clears close-on-exec on the copies
+        posix_spawn_file_actions_adddup2(&actions, output_fd, STDOUT_FILENO);
+        posix_spawn_file_actions_adddup2(&actions, output_fd, STDERR_FILENO);
+    }
+    pid_t pid;
+    // posix_spawn doesn't touch argv, the signature just predates const
+    int error = posix_spawn(&pid, program->path.c_str(), &actions, &program->attr, program->argv.data(), environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (error != 0)
+        throw std::system_error(error, std::generic_category(), "posix_spawn " + program->path);
+    return pid;
+}
+
+const std::string &secman::ProcessRunner::command() const
+{
+    return program->command;
+}
+
+bool secman::ProcessRunner::uses_shell() const
+{
+    return program->shell;
+}
@@ -0,0 +1,57 @@
+#ifndef SECMAN_PROCESS_RUNNER_H
+#define SECMAN_PROCESS_RUNNER_H
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <spawn.h>
+#include <sys/types.h>
+
+namespace secman
+{
+    // runs a shell command line as a child process, replacing system()
+    // the command is split into words and the executable looked up in PATH once, when the runner is made,
+    // every run is then a single posix_spawn of that executable.
+    // /bin/sh -c is only used when the command needs the shell:
+    // quoting, redirections, pipes, variables, globs, or a name that is not an executable in PATH (builtins)
+    // copies share the prepared command, so binding a runner into a task is cheap
+    class ProcessRunner
+    {
+    public:
+        explicit ProcessRunner(const std::string &command);
+
+        // starts the command and waits for it, returns the status as reported by waitpid
+        // throws std::system_error if the process can't be started
+        int operator()() const;
+
+        // starts the command without waiting, the caller has to reap the child
+        pid_t spawn() const;
+        // same, with the child's stdout and stderr going to output_fd
+        pid_t spawn(int output_fd) const;
+
+        const std::string &command() const;
+        bool uses_shell() const;
+
+    private:
+        struct Program
+        {
+            std::string command;
+            std::string path;
+            std::vector<std::string> args;
+            std::vector<char *> argv;  // into args, null terminated
+            bool shell;
+            // the child starts with an empty signal mask and default SIGINT, SIGQUIT, SIGCHLD and SIGPIPE
+            // whatever the spawning worker thread had
+            posix_spawnattr_t attr;
+
+            Program();
+            Program(const Program &) = delete;
+            Program& operator=(const Program &) = delete;
+            ~Program();
+        };
+
+        std::shared_ptr<const Program> program;
+    };
+}
+
+#endif
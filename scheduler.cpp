@@ -1,102 +1,869 @@
+#include <algorithm>
+#include <ctime>
 #include "scheduler.hpp"
 
-secman::Task::Task(std::function<void()> &&f, bool recur, bool interval) : f(std::move(f)), recur(recur), interval(interval) {}
+namespace
+{
+    // the run of the job on this pool thread
+    thread_local std::shared_ptr<secman::Run> current;
+}
+
+secman::Task::Task(std::function<void()> &&f, bool recur, bool interval)
+        : f(std::move(f)), recur(recur), interval(interval), id(0), timer(TimerQueue::no_handle),
+          running(0), queued(0), waiting(false), times(nullptr) {}
+
+secman::Task::~Task()
+{
+    delete times.load();
+}
+
+secman::Run::Run(std::shared_ptr<Owner> owner, std::shared_ptr<Task> task)
+        : owner(std::move(owner)), task(std::move(task)), stopped(false)
+{
+    group = this->task->group;
+    ++this->task->running;
+    if (group)
+        ++group->running;
+    ++this->owner->running;
+}
+
+secman::Run::~Run()
+{
+    --task->running;
+    if (group)
+        --group->running;
+    --owner->running;
+    // the queues are only looked at after the counters went down, see Scheduler::start_queued
+    if (task->queued == 0 && (!group || group->waiting == 0))
+        return;
+    std::lock_guard<std::mutex> lg(owner->m);
+    if (auto scheduler = owner->scheduler)
+        scheduler->post(Scheduler::Request{Scheduler::Request::Kind::call, nullptr, {},
+                                           [scheduler, task = task, group = group]() { scheduler->finished(task, group); }});
+}
+
+void secman::Run::on_stop(std::function<void()> stop)
+{
+    std::unique_lock<std::mutex> lock(m);
+    if (stopped && stop)
+    {
+        lock.unlock();
+        stop();
+        return;
+    }
+    stopper = std::move(stop);
+}
+
+void secman::Run::stop()
+{
+    std::unique_lock<std::mutex> lock(m);
+    stopped = true;
+    auto stop = std::move(stopper);
+    stopper = nullptr;
+    lock.unlock();
+    if (stop)
+        stop();
+}
 
 secman::InTask::InTask(std::function<void()> &&f) : Task(std::move(f)) {}
 
-std::chrono::system_clock::time_point secman::InTask::get_new_time() const
+std::chrono::system_clock::time_point secman::InTask::get_new_time(std::chrono::system_clock::time_point) const
 {
     return std::chrono::system_clock::time_point(std::chrono::system_clock::duration(0));
 }
 
 secman::EveryTask::EveryTask(std::chrono::system_clock::duration time, std::function<void()> &&f, bool interval) : Task(std::move(f), true, interval), time(time) {}
 
-std::chrono::system_clock::time_point secman::EveryTask::get_new_time() const
+std::chrono::system_clock::time_point secman::EveryTask::get_new_time(std::chrono::system_clock::time_point now) const
 {
-    return std::chrono::system_clock::now() + time;
+    return now + time;
 };
 
-secman::CronTask::CronTask(const std::string &expression, std::function<void()> &&f) : Task(std::move(f), true), cron(expression) {}
+secman::CronTask::CronTask(const std::string &expression, std::function<void()> &&f)
+        : Task(std::move(f), true), cron(expression), slot(0), member(0) {}
 
-std::chrono::system_clock::time_point secman::CronTask::get_new_time() const
+secman::CronTask::CronTask(const Cron &cron, std::function<void()> &&f)
+        : Task(std::move(f), true), cron(cron), slot(0), member(0) {}
+
+std::chrono::system_clock::time_point secman::CronTask::get_new_time(std::chrono::system_clock::time_point now) const
 {
-    return cron.cron_to_next();
+    return cron.cron_to_next(now);
 }
 
-secman::Scheduler::Scheduler(unsigned int max_n_tasks) : done(false), threads(max_n_tasks + 1)
+secman::Scheduler::Scheduler(unsigned int max_n_tasks, TimerBackend backend, const tp::placement &placement)
+        : done(false), tasks(make_timer_queue(backend)), last_id(0), n_cron_tasks(0),
+          owner(std::make_shared<Run::Owner>()), n_skipped(0), n_throttled(0),
+          default_slack(0), n_wakeups(0), task_latency_on(false), threads(static_cast<int>(max_n_tasks), placement),
+          dispatcher_cpu(placement.reserved_cpu)
 {
-    threads.push([this](int)
-                 {
-                     while (!done)
-                     {
-                         if (tasks.empty())
-                         {
-                             sleeper.sleep();
-                         }
-                         else
-                         {
-                             auto time_of_first_task = (*tasks.begin()).first;
-                             sleeper.sleep_until(time_of_first_task);
-                         }
-                         std::lock_guard<std::mutex> l(lock);
-                         manage_tasks();
-                     }
-                 });
+    owner->scheduler = this;
+    dispatcher = std::thread(&Scheduler::dispatch_loop, this);
 }
 
 secman::Scheduler::~Scheduler()
 {
     done = true;
     sleeper.interrupt();
+    dispatcher.join();
+    // runs that end later have no one to tell
+    std::lock_guard<std::mutex> lg(owner->m);
+    owner->scheduler = nullptr;
 }
 
-void secman::Scheduler::add_task(const std::chrono::system_clock::time_point time, std::shared_ptr<secman::Task> t)
+void secman::Scheduler::dispatch_loop()
 {
-    std::lock_guard<std::mutex> l(lock);
-    tasks.emplace(time, std::move(t));
-    sleeper.interrupt();
+    if (dispatcher_cpu >= 0)
+        tp::pin_current_thread({dispatcher_cpu});
+    while (!done)
+    {
+        ++n_wakeups;
+        inbox.drain([this](Request &&request) { apply(std::move(request)); });
+        manage_tasks();
+        auto wakeup = next_wakeup();
+        if (wakeup == std::chrono::system_clock::time_point::max())
+        {
+            sleeper.sleep();
+        }
+        else
+        {
+            sleeper.sleep_until(wakeup);
+        }
+    }
+    // answer the calls still waiting
+    inbox.drain([this](Request &&request) { apply(std::move(request)); });
 }
 
-void secman::Scheduler::manage_tasks()
+void secman::Scheduler::post(Request request)
+{
+    // the dispatcher drains the whole inbox on each wake up, so only the first message needs to wake it
+    if (inbox.push(std::move(request)))
+        sleeper.interrupt();
+}
+
+void secman::Scheduler::apply(Request &&request)
+{
+    auto &t = request.task;
+    switch (request.kind)
+    {
+        case Request::Kind::add:
+            join_group(*t);
+            enqueue(t, request.time);
+            index.emplace(t->id, std::move(t));
+            break;
+        case Request::Kind::add_cron:
+        {
+            if (crons.empty())
+                next_cron_tick = std::chrono::floor<std::chrono::minutes>(std::chrono::system_clock::now()) + std::chrono::minutes(1);
+            join_group(*t);
+            add_to_group(std::static_pointer_cast<CronTask>(t));
+            index.emplace(t->id, std::move(t));
+            break;
+        }
+        case Request::Kind::rearm:
+            // unless it was cancelled or rescheduled while it ran
+            if (t->timer == TimerQueue::no_handle && index.find(t->id) != index.end())
+                enqueue(t, request.time);
+            break;
+        case Request::Kind::call:
+            request.call();
+            break;
+    }
+}
+
+secman::TaskId secman::Scheduler::add_task(const std::chrono::system_clock::time_point time, std::shared_ptr<secman::Task> t)
+{
+    auto id = ++last_id;
+    t->id = id;
+    post(Request{Request::Kind::add, std::move(t), time, nullptr});
+    return id;
+}
+
+secman::TaskId secman::Scheduler::add_cron_task(std::shared_ptr<secman::CronTask> t)
+{
+    auto id = ++last_id;
+    t->id = id;
+    post(Request{Request::Kind::add_cron, std::move(t), {}, nullptr});
+    return id;
+}
+
+void secman::Scheduler::rearm(std::shared_ptr<secman::Task> t)
+{
+    auto time = t->get_new_time(std::chrono::system_clock::now());
+    post(Request{Request::Kind::rearm, std::move(t), time, nullptr});
+}
+
+bool secman::Scheduler::cancel(TaskId id)
+{
+    return ask([this, id]() { return remove(id); });
+}
+
+std::size_t secman::Scheduler::cancel(const std::vector<TaskId> &ids)
+{
+    return ask([this, &ids]()
+               {
+                   std::size_t n = 0;
+                   for (auto id : ids)
+                       n += remove(id);
+                   return n;
+               });
+}
+
+bool secman::Scheduler::remove(TaskId id)
+{
+    auto i = index.find(id);
+    if (i == index.end())
+        return false;
+    auto &task = i->second;
+    if (task->timer != TimerQueue::no_handle)
+    {
+        tasks->erase(task->timer);
+        task->timer = TimerQueue::no_handle;
+    }
+    else if (auto cron_task = dynamic_cast<CronTask *>(task.get()))
+        remove_from_group(*cron_task);
+    index.erase(i);
+    return true;
+}
+
+void secman::Scheduler::add_to_group(const std::shared_ptr<CronTask> &task)
+{
+    auto schedule = schedules.find(task->cron);
+    if (schedule == schedules.end())
+    {
+        auto slot = crons.insert(task->cron);
+        if (cron_groups.size() <= slot)
+            cron_groups.resize(slot + 1);
+        schedule = schedules.emplace(task->cron, slot).first;
+    }
+    auto &group = cron_groups[schedule->second];
+    task->slot = schedule->second;
+    task->member = group.members.size();
+    group.members.push_back(task);
+    ++n_cron_tasks;
+}
+
+void secman::Scheduler::remove_from_group(const CronTask &task)
+{
+    // the last member takes the place of the removed one
+    auto &members = cron_groups[task.slot].members;
+    members[task.member] = std::move(members.back());
+    members[task.member]->member = task.member;
+    members.pop_back();
+    --n_cron_tasks;
+    if (members.empty())
+    {
+        members.shrink_to_fit();
+        // the slot may go to another schedule
+        cron_groups[task.slot].minute = {};
+        crons.erase(task.slot);
+        schedules.erase(task.cron);
+    }
+}
+
+bool secman::Scheduler::reschedule(TaskId id, std::chrono::system_clock::time_point time)
+{
+    return ask([this, id, time]()
+               {
+                   auto i = index.find(id);
+                   if (i == index.end())
+                       return false;
+                   auto &task = i->second;
+                   if (dynamic_cast<CronTask *>(task.get()))
+                       return false;
+                   if (task->timer != TimerQueue::no_handle)
+                       tasks->erase(task->timer);
+                   enqueue(task, time);
+                   return true;
+               });
+}
+
+std::optional<secman::TaskInfo> secman::Scheduler::lookup(TaskId id)
+{
+    return ask([this, id]() -> std::optional<TaskInfo>
+               {
+                   auto i = index.find(id);
+                   if (i == index.end())
+                       return std::nullopt;
+                   return info_of(*i->second);
+               });
+}
+
+std::vector<secman::TaskInfo> secman::Scheduler::list()
+{
+    return ask([this]()
+               {
+                   std::vector<TaskInfo> result;
+                   result.reserve(index.size());
+                   for (auto &i : index)
+                       result.push_back(info_of(*i.second));
+                   return result;
+               });
+}
+
+secman::SchedulerStats secman::Scheduler::stats()
+{
+    auto result = ask([this]()
+                      {
+                          // asked on the dispatcher thread, so this is its own time
+                          timespec cpu{};
+                          clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+                          return SchedulerStats{index.size(), tasks->size(), n_cron_tasks, crons.size(),
+                                                owner->running, n_skipped, n_throttled, delayed.size(), n_wakeups,
+                                                std::chrono::seconds(cpu.tv_sec) + std::chrono::nanoseconds(cpu.tv_nsec)};
+                      });
+    result.threads = threads.size();
+    result.idle_threads = threads.n_idle();
+    result.pool_queued = threads.n_queued();
+    result.pool_wakeups = threads.n_wakeups();
+    return result;
+}
+
+tp::thread_pool& secman::Scheduler::pool()
+{
+    return threads;
+}
+
+secman::TaskId secman::Scheduler::reserve_id()
+{
+    return ++last_id;
+}
+
+void secman::Scheduler::restore(std::vector<TimerQueue::entry> saved)
 {
-    auto end_of_tasks_to_run = tasks.upper_bound(std::chrono::system_clock::now());
+    // ids handed out from now on have to be above the restored ones
+    TaskId max_id = 0;
+    for (auto &i : saved)
+        max_id = std::max(max_id, i.second->id);
+    auto id = last_id.load();
+    while (id < max_id && !last_id.compare_exchange_weak(id, max_id));
 
-    // if there are any tasks to be run and removed
-    if (end_of_tasks_to_run != tasks.begin())
+    auto batch = std::make_shared<std::vector<TimerQueue::entry>>(std::move(saved));
+    post(Request{Request::Kind::call, nullptr, {}, [this, batch]()
     {
-        decltype(tasks) recurred_tasks;
+        for (auto &i : *batch)
+        {
+            bool cron = dynamic_cast<CronTask *>(i.second.get()) != nullptr;
+            apply(Request{cron ? Request::Kind::add_cron : Request::Kind::add, std::move(i.second), i.first, nullptr});
+        }
+    }});
+}
 
-        for (auto i = tasks.begin(); i != end_of_tasks_to_run; ++i)
+secman::TaskInfo secman::Scheduler::info_of(const Task &t)
+{
+    TaskInfo info{t.id, std::nullopt, t.recur, t.interval};
+    if (t.timer != TimerQueue::no_handle)
+        info.next = tasks->time_of(t.timer);
+    else if (auto cron_task = dynamic_cast<const CronTask *>(&t))
+    {
+        // the next run only depends on the minute and is the same for the whole group
+        auto now = std::chrono::system_clock::now();
+        auto minute = std::chrono::floor<std::chrono::minutes>(now);
+        auto &group = cron_groups[cron_task->slot];
+        if (group.minute != minute)
         {
+            group.next = cron_task->get_new_time(now);
+            group.minute = minute;
+        }
+        info.next = group.next;
+    }
+    return info;
+}
 
-            auto &task = (*i).second;
+void secman::Scheduler::manage_tasks()
+{
+    auto now = std::chrono::system_clock::now();
+    tasks->pop_expired(now, expired);
 
-            if (task->interval)
-            {
-                // if it's an interval task, add the task back after f() is completed
-                threads.push([this, task](int)
-                             {
-                                 task->f();
-                                 add_task(task->get_new_time(), task);
-                             });
-            }
+    for (auto &i : expired)
+    {
+        auto &task = i.second;
+        task->timer = TimerQueue::no_handle;
+
+        if (task->interval)
+        {
+            // if it's an interval task, add the task back after f() is completed
+            dispatch(task, task->due);
+        }
+        else
+        {
+            dispatch(task, task->due);
+            // calculate time of next run and put the task back, the expired ones are already out of the queue
+            // counted without the rounding up to the slack, so it doesn't add up over the runs
+            if (task->recur)
+                enqueue(task, task->get_new_time(now - (i.first - task->due)));
             else
+                index.erase(task->id);
+        }
+    }
+
+    expired.clear();
+
+    if (!crons.empty() && now >= next_cron_tick)
+        run_cron_ticks(now);
+
+    release_held(now);
+
+    // the jobs record the rest of their times, see Job::operator()
+    if (!batch.empty())
+    {
+        auto &local = run_times.local();
+        for (auto &job : batch)
+        {
+            auto &task = *job.task;
+            auto own = task.times.load(std::memory_order_relaxed);
+            if (!own && task_latency_on)
             {
-                threads.push([task](int)
-                             {
-                                 task->f();
-                             });
-                // calculate time of next run and add the new task to the tasks to be recurred
-                if (task->recur)
-                    recurred_tasks.emplace(task->get_new_time(), std::move(task));
+                own = new RunTimes();
+                task.times.store(own, std::memory_order_release);
             }
+            local.lateness.record_alone(now - job.due);
+            if (own)
+                own->lateness.record(now - job.due);
         }
+    }
+
+    // everything due in this pass goes to the pool in one go
+    int nodes = threads.nodes();
+    threads.post_batch(batch.begin(), batch.end(),
+                       [nodes](const Job &job)
+                       {
+                           return tp::urgency{job.task->policy.priority, job.due, job.task->group ? job.task->group->tenant : 0,
+                                              nodes > 1 ? static_cast<int>(job.task->id % static_cast<TaskId>(nodes)) : -1};
+                       });
+    batch.clear();
+}
 
-        // remove the completed tasks
-        tasks.erase(tasks.begin(), end_of_tasks_to_run);
+void secman::Scheduler::run_cron_ticks(std::chrono::system_clock::time_point now)
+{
+    // minutes the dispatcher slept through are caught up, up to an hour back
+    // the matches are ORed together so a task runs at most once per pass
+    auto current_minute = std::chrono::floor<std::chrono::minutes>(now);
+    auto tick = std::max(next_cron_tick, std::chrono::system_clock::time_point(current_minute - std::chrono::minutes(59)));
+    for (; tick <= now; tick += std::chrono::minutes(1))
+    {
+        auto tick_t = std::chrono::system_clock::to_time_t(tick);
+        std::tm tm{};
+        localtime_r(&tick_t, &tm);
+        crons.match(tm, due);
+    }
+    next_cron_tick = current_minute + std::chrono::minutes(1);
 
-        // re-add the tasks that are recurring
-        for (auto &task : recurred_tasks)
-            tasks.emplace(task.first, std::move(task.second));
+    for (std::size_t w = 0; w < due.size(); ++w)
+    {
+        for (auto bits = due[w]; bits != 0; bits &= bits - 1)
+            for (auto &task : cron_groups[w * 64 + __builtin_ctzll(bits)].members)
+                dispatch(task, current_minute);
+        due[w] = 0;
+    }
+}
+
+void secman::Scheduler::dispatch(const std::shared_ptr<Task> &task, std::chrono::system_clock::time_point due)
+{
+    auto &policy = task->policy;
+    if (policy.overlap == Overlap::replace)
+        for (auto &i : task->runs)
+            if (auto run = i.lock())
+                run->stop();
+    if (can_start(*task))
+    {
+        start(task, due);
+        return;
+    }
+    // a one-shot task has no later run to wait for, it always waits for its turn
+    if (!task->recur || (policy.overlap == Overlap::queue && task->queued < policy.max_queued))
+    {
+        ++task->queued;
+        start_queued(task);
+        return;
     }
+    ++n_skipped;
+    // an interval task is put back by its run, without one it goes back now
+    if (task->interval && index.find(task->id) != index.end())
+        enqueue(task, task->get_new_time(std::chrono::system_clock::now()));
+}
+
+bool secman::Scheduler::can_start(const Task &task) const
+{
+    auto overlap = task.policy.overlap;
+    if ((overlap == Overlap::skip || overlap == Overlap::queue) && task.running >= task.policy.max_running)
+        return false;
+    return !task.group || task.group->limit == 0 || task.group->running < task.group->limit;
+}
+
+void secman::Scheduler::start_queued(const std::shared_ptr<Task> &task)
+{
+    // a run ending on another thread lowers its counters before it looks at queued and waiting,
+    // these go up before the counters are checked here, so one of the two sides sees the other
+    while (task->queued > 0)
+    {
+        // a queued run is due once it can start
+        if (can_start(*task))
+        {
+            --task->queued;
+            start(task, std::chrono::system_clock::now());
+            continue;
+        }
+        auto &group = task->group;
+        if (!group || task->waiting || group->limit == 0 || group->running < group->limit)
+            return;
+        // blocked by the group, the next run of the group that ends lets it go on
+        task->waiting = true;
+        group->waiters.push_back(task);
+        ++group->waiting;
+    }
+}
+
+void secman::Scheduler::finished(const std::shared_ptr<Task> &task, const std::shared_ptr<RunGroup> &group)
+{
+    if (task)
+        start_queued(task);
+    if (!group)
+        return;
+    while (!group->waiters.empty() && (group->limit == 0 || group->running < group->limit))
+    {
+        auto waiter = std::move(group->waiters.front());
+        group->waiters.pop_front();
+        --group->waiting;
+        waiter->waiting = false;
+        start_queued(waiter);
+    }
+}
+
+void secman::Scheduler::start(const std::shared_ptr<Task> &task, std::chrono::system_clock::time_point due)
+{
+    auto run = std::make_shared<Run>(owner, task);
+    if (task->policy.overlap == Overlap::replace)
+    {
+        task->runs.erase(std::remove_if(task->runs.begin(), task->runs.end(),
+                                        [](const std::weak_ptr<Run> &i) { return i.expired(); }),
+                         task->runs.end());
+        task->runs.push_back(run);
+    }
+    Job job{this, task, std::move(run), due};
+    auto now = std::chrono::system_clock::now();
+    if (task->policy.jitter.count() > 0)
+    {
+        // splitmix64 of the id, so tasks with close ids still spread out
+        auto h = task->id + 0x9e3779b97f4a7c15;
+        h = (h ^ h >> 30) * 0xbf58476d1ce4e5b9;
+        h = (h ^ h >> 27) * 0x94d049bb133111eb;
+        h ^= h >> 31;
+        auto offset = std::chrono::milliseconds(h % static_cast<std::uint64_t>(task->policy.jitter.count()));
+        job.due = now + offset;
+        auto at = job.due;
+        delayed.emplace(at, std::move(job));
+        return;
+    }
+    release(std::move(job), now);
+}
+
+void secman::Scheduler::release(Job &&job, std::chrono::system_clock::time_point now)
+{
+    auto group = job.task->group.get();
+    if (group && !group->starts.unlimited())
+    {
+        auto waiting = group_throttled.find(group);
+        if (waiting != group_throttled.end() || !group->starts.take(now))
+        {
+            group_throttled[group].push_back(std::move(job));
+            ++n_throttled;
+            return;
+        }
+    }
+    release_global(std::move(job), now);
+}
+
+void secman::Scheduler::release_global(Job &&job, std::chrono::system_clock::time_point now)
+{
+    // the runs already waiting go first
+    if (!throttled.empty() || !starts.take(now))
+    {
+        throttled.push_back(std::move(job));
+        ++n_throttled;
+        return;
+    }
+    batch.push_back(std::move(job));
+}
+
+void secman::Scheduler::release_held(std::chrono::system_clock::time_point now)
+{
+    while (!delayed.empty() && delayed.begin()->first <= now)
+    {
+        auto job = std::move(delayed.begin()->second);
+        delayed.erase(delayed.begin());
+        release(std::move(job), now);
+    }
+    while (!throttled.empty() && starts.take(now))
+    {
+        batch.push_back(std::move(throttled.front()));
+        throttled.pop_front();
+        --n_throttled;
+    }
+    for (auto i = group_throttled.begin(); i != group_throttled.end();)
+    {
+        auto &jobs = i->second;
+        while (!jobs.empty() && i->first->starts.take(now))
+        {
+            --n_throttled;
+            release_global(std::move(jobs.front()), now);
+            jobs.pop_front();
+        }
+        if (jobs.empty())
+            i = group_throttled.erase(i);
+        else
+            ++i;
+    }
+}
+
+void secman::Scheduler::limit_rate(double per_second, double burst)
+{
+    ask([this, per_second, burst]()
+        {
+            starts.set(per_second, burst);
+            return true;
+        });
+}
+
+void secman::Scheduler::limit_group_rate(const std::string &name, double per_second, double burst)
+{
+    ask([this, &name, per_second, burst]()
+        {
+            group_named(name).starts.set(per_second, burst);
+            return true;
+        });
+}
+
+void secman::Scheduler::set_slack(std::chrono::milliseconds slack)
+{
+    ask([this, slack]()
+        {
+            default_slack = slack;
+            return true;
+        });
+}
+
+std::chrono::system_clock::duration secman::Scheduler::slack_of(const Task &t) const
+{
+    return t.policy.slack.count() > 0 ? t.policy.slack : default_slack;
+}
+
+void secman::Scheduler::enqueue(const std::shared_ptr<Task> &t, std::chrono::system_clock::time_point due)
+{
+    t->due = due;
+    // the slots are aligned to the epoch, so tasks with the same slack share them whatever their period
+    auto slack = slack_of(*t);
+    if (slack.count() > 0 && due != std::chrono::system_clock::time_point::max())
+    {
+        auto past = due.time_since_epoch() % slack;
+        if (past.count() > 0)
+            due += slack - past;
+    }
+    t->timer = tasks->insert(due, t);
+}
+
+void secman::Scheduler::join_group(Task &task)
+{
+    if (task.policy.group.empty())
+    {
+        task.group = nullptr;
+        return;
+    }
+    group_named(task.policy.group);
+    task.group = groups[task.policy.group];
+}
+
+secman::RunGroup &secman::Scheduler::group_named(const std::string &name)
+{
+    auto &group = groups[name];
+    if (!group)
+    {
+        group = std::make_shared<RunGroup>();
+        group->tenant = threads.add_tenant();
+    }
+    return *group;
+}
+
+bool secman::Scheduler::set_policy(TaskId id, RunPolicy policy)
+{
+    return ask([this, id, &policy]()
+               {
+                   auto i = index.find(id);
+                   if (i == index.end())
+                       return false;
+                   i->second->policy = std::move(policy);
+                   join_group(*i->second);
+                   return true;
+               });
+}
+
+void secman::Scheduler::limit_group(const std::string &name, unsigned int limit)
+{
+    ask([this, &name, limit]()
+        {
+            group_named(name).limit = limit;
+            // a higher limit lets waiting runs go
+            finished(nullptr, groups[name]);
+            return true;
+        });
+}
+
+void secman::Scheduler::set_group_weight(const std::string &name, unsigned int weight)
+{
+    ask([this, &name, weight]()
+        {
+            auto &group = group_named(name);
+            group.weight = weight;
+            threads.set_tenant(group.tenant, weight);
+            return true;
+        });
+}
+
+std::vector<secman::GroupStats> secman::Scheduler::group_stats()
+{
+    auto result = ask([this]()
+                      {
+                          std::vector<std::pair<GroupStats, int>> found;
+                          for (auto &i : groups)
+                          {
+                              auto &group = *i.second;
+                              GroupStats stats{};
+                              stats.name = i.first;
+                              stats.limit = group.limit;
+                              stats.weight = group.weight;
+                              stats.running = group.running;
+                              stats.waiting = group.waiting;
+                              found.emplace_back(std::move(stats), group.tenant);
+                          }
+                          return found;
+                      });
+    auto tenants = threads.tenants();
+    std::vector<GroupStats> stats;
+    stats.reserve(result.size());
+    for (auto &i : result)
+    {
+        auto &tenant = tenants.at(static_cast<std::size_t>(i.second));
+        i.first.queued = tenant.queued;
+        i.first.started = tenant.started;
+        i.first.mean_wait = tenant.mean_wait;
+        i.first.max_wait = tenant.max_wait;
+        stats.push_back(std::move(i.first));
+    }
+    return stats;
+}
+
+namespace
+{
+    void add(secman::LatencyStats &to, const secman::RunTimes &times)
+    {
+        to.lateness.merge(times.lateness);
+        to.wait.merge(times.wait);
+        to.run.merge(times.run);
+    }
+}
+
+secman::LatencyStats secman::Scheduler::latency()
+{
+    LatencyStats result;
+    run_times.for_each([&result](const RunTimes &times) { add(result, times); });
+    return result;
+}
+
+std::optional<secman::LatencyStats> secman::Scheduler::latency(TaskId id)
+{
+    return ask([this, id]() -> std::optional<LatencyStats>
+               {
+                   auto i = index.find(id);
+                   if (i == index.end())
+                       return std::nullopt;
+                   LatencyStats result;
+                   if (auto times = i->second->times.load())
+                       add(result, *times);
+                   return result;
+               });
+}
+
+std::vector<std::pair<secman::TaskId, secman::LatencyStats>> secman::Scheduler::task_latency()
+{
+    return ask([this]()
+               {
+                   std::vector<std::pair<TaskId, LatencyStats>> result;
+                   for (auto &i : index)
+                       if (auto times = i.second->times.load())
+                       {
+                           result.emplace_back(i.first, LatencyStats{});
+                           add(result.back().second, *times);
+                       }
+                   std::sort(result.begin(), result.end(),
+                             [](const std::pair<TaskId, LatencyStats> &a, const std::pair<TaskId, LatencyStats> &b)
+                             { return a.first < b.first; });
+                   return result;
+               });
+}
+
+void secman::Scheduler::record_task_latency(bool on)
+{
+    ask([this, on]()
+        {
+            task_latency_on = on;
+            return true;
+        });
+}
+
+std::shared_ptr<secman::Run> secman::Scheduler::current_run()
+{
+    return current;
+}
+
+void secman::Scheduler::Job::operator()(int) const
+{
+    // the pool read the clock when the job went in its queue and when it came out, only the end is left to read
+    std::chrono::steady_clock::time_point posted, start;
+    bool timed = tp::thread_pool::current_times(posted, start);
+    if (!timed)
+        start = std::chrono::steady_clock::now();
+    auto &local = scheduler->run_times.local();
+    auto own = task->times.load(std::memory_order_acquire);
+    if (timed)
+    {
+        local.wait.record_alone(start - posted);
+        if (own)
+            own->wait.record(start - posted);
+    }
+    auto record_run = [&local, own, start]()
+    {
+        auto took = std::chrono::steady_clock::now() - start;
+        local.run.record_alone(took);
+        if (own)
+            own->run.record(took);
+    };
+    current = run;
+    try
+    {
+        task->f();
+    }
+    catch (...)
+    {
+        current = nullptr;
+        record_run();
+        throw;
+    }
+    current = nullptr;
+    record_run();
+    if (task->interval)
+        scheduler->rearm(task);
+}
+
+std::chrono::system_clock::time_point secman::Scheduler::next_wakeup()
+{
+    auto wakeup = crons.empty() ? std::chrono::system_clock::time_point::max() : next_cron_tick;
+    if (!tasks->empty())
+        wakeup = std::min(wakeup, tasks->next_expiry());
+    if (!delayed.empty())
+        wakeup = std::min(wakeup, delayed.begin()->first);
+    auto now = std::chrono::system_clock::now();
+    if (!throttled.empty())
+        wakeup = std::min(wakeup, starts.next_token(now));
+    for (auto &i : group_throttled)
+        wakeup = std::min(wakeup, i.first->starts.next_token(now));
+    return wakeup;
 }
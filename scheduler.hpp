@@ -1,26 +1,175 @@
 #ifndef SECMAN_SCHEDULER_H
 #define SECMAN_SCHEDULER_H
 
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
 #include <iomanip>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
 
 #include "tread_pool.hpp"
 #include "interruptable_sleep.hpp"
 #include "cron.hpp"
+#include "cron_index.hpp"
+#include "timer_queue.hpp"
+#include "inbox.hpp"
+#include "token_bucket.hpp"
+#include "histogram.hpp"
 
 namespace secman
 {
+    // identifies a scheduled task for its whole lifetime, ids are never reused
+    using TaskId = std::uint64_t;
+
+    class Task;
+    class Run;
+    class Scheduler;
+
+    // what happens to a run of a task that comes due while earlier runs of it are still going
+    enum class Overlap : std::uint8_t
+    {
+        allow,    // it starts anyway
+        skip,     // it is dropped if max_running runs are going
+        queue,    // it waits for one of the max_running runs to end, at most max_queued wait and the rest are dropped
+        replace,  // the running ones are asked to stop and it starts right away
+    };
+
+    struct RunPolicy
+    {
+        Overlap overlap = Overlap::allow;
+        unsigned int max_running = 1;
+        unsigned int max_queued = 1;
+        // the runs start up to this much after they are due, each task by its own fixed amount worked out from its id,
+        // for spreading jobs that fire at the same minute. keep it below the period of the task
+        std::chrono::milliseconds jitter{0};
+        // the runs may start up to this much late, so that timers due close together share one wake up of the dispatcher,
+        // like the timer slack of Linux. the time of each run is rounded up to a multiple of the slack.
+        // 0 for the scheduler's default, see Scheduler::set_slack. cron tasks always fire on the minute
+        std::chrono::milliseconds slack{0};
+        // when the pool has a backlog the runs of higher priorities start first, the same priorities by their due time.
+        // a run overdue by the aging of the pool goes before the ones one priority higher, see tp::thread_pool::set_aging
+        int priority = 0;
+        // the runs of all tasks of a group count against the group's limit, see Scheduler::limit_group.
+        // a run that finds its group full waits if the task queues and is dropped otherwise,
+        // the run of a one-shot task is never dropped
+        std::string group;
+    };
+
+    // limits the runs of several tasks together
+    // the group is a tenant of the pool too, so a group with a backlog of runs gets no more than its share of the threads
+    struct RunGroup
+    {
+        unsigned int limit = 0;  // 0 for none
+        unsigned int weight = 1;
+        int tenant = 0;          // in the pool
+        std::atomic<unsigned int> running{0};
+        std::atomic<unsigned int> waiting{0};
+        // only used on the dispatcher thread: tasks with runs waiting for the group and the starts per second
+        std::deque<std::shared_ptr<Task>> waiters;
+        TokenBucket starts;
+    };
+
+    // what a run went through, each step in a histogram of its own
+    struct RunTimes
+    {
+        Histogram lateness;  // from the time it was due, before rounding up to the slack, to going to the pool
+        Histogram wait;      // in the pool's queue until a thread took it
+        Histogram run;       // of the job itself
+    };
+
+    struct LatencyStats
+    {
+        HistogramSnapshot lateness;
+        HistogramSnapshot wait;
+        HistogramSnapshot run;
+    };
+
     class Task
     {
     public:
         explicit Task(std::function<void()> &&f, bool recur = false, bool interval = false);
+        virtual ~Task();
 
-        virtual std::chrono::system_clock::time_point get_new_time() const = 0;
+        // time of the run after the one due at now, now is passed in so a whole batch shares one clock read
+        virtual std::chrono::system_clock::time_point get_new_time(std::chrono::system_clock::time_point now) const = 0;
 
         std::function<void()> f;
 
         bool recur;
         bool interval;
+
+        TaskId id;
+        // position in the timer queue, no_handle while the task is running or after it was cancelled
+        TimerQueue::handle timer;
+        // when the next run is due before it was rounded up to the slack, used on the dispatcher thread only
+        std::chrono::system_clock::time_point due;
+
+        // set before the task is added, or with Scheduler::set_policy
+        RunPolicy policy;
+
+        // the rest is kept by the scheduler
+        std::atomic<unsigned int> running;
+        std::atomic<unsigned int> queued;
+        // used on the dispatcher thread only: the group named by the policy, whether the task is among its waiters
+        // and the runs to stop for Overlap::replace
+        std::shared_ptr<RunGroup> group;
+        bool waiting;
+        std::vector<std::weak_ptr<Run>> runs;
+        // the times of the task's own runs, made by the dispatcher while Scheduler::record_task_latency is on
+        // and kept as long as the task. its runs still going read it as it is set
+        std::atomic<RunTimes *> times;
+    };
+
+    // one run of a task, it ends when the last copy is gone
+    // the job gets it from Scheduler::current_run, one that starts something finishing later,
+    // like a process, keeps a copy until then
+    class Run
+    {
+    public:
+        // shared by the runs and their scheduler, which may be gone before the last run ends
+        struct Owner
+        {
+            std::mutex m;
+            Scheduler *scheduler;
+            std::atomic<std::size_t> running{0};
+        };
+
+        Run(std::shared_ptr<Owner> owner, std::shared_ptr<Task> task);
+        Run(const Run &) = delete;
+        Run& operator=(const Run &) = delete;
+        ~Run();
+
+        // how to stop the run when a newer one replaces it, nullptr once there is nothing left to stop
+        // called right away if the run was asked to stop already
+        void on_stop(std::function<void()> stop);
+        void stop();
+
+    private:
+        std::shared_ptr<Owner> owner;
+        std::shared_ptr<Task> task;
+        std::shared_ptr<RunGroup> group;
+
+        std::mutex m;
+        std::function<void()> stopper;
+        bool stopped;
+    };
+
+    struct TaskInfo
+    {
+        TaskId id;
+        // time of the next run, nullopt while an interval task is running
+        std::optional<std::chrono::system_clock::time_point> next;
+        bool recur;
+        bool interval;
     };
 
     class InTask : public Task
@@ -28,7 +177,7 @@ namespace secman
     public:
         explicit InTask(std::function<void()> &&f);
         // dummy time_point because it's not used
-        std::chrono::system_clock::time_point get_new_time() const override;
+        std::chrono::system_clock::time_point get_new_time(std::chrono::system_clock::time_point now) const override;
     };
 
     class EveryTask : public Task
@@ -36,7 +185,7 @@ namespace secman
     public:
         EveryTask(std::chrono::system_clock::duration time, std::function<void()> &&f, bool interval = false);
 
-        std::chrono::system_clock::time_point get_new_time() const override;
+        std::chrono::system_clock::time_point get_new_time(std::chrono::system_clock::time_point now) const override;
         std::chrono::system_clock::duration time;
     };
 
@@ -44,8 +193,14 @@ namespace secman
     {
     public:
         CronTask(const std::string &expression, std::function<void()> &&f);
-        std::chrono::system_clock::time_point get_new_time() const override;
+        CronTask(const Cron &cron, std::function<void()> &&f);
+        std::chrono::system_clock::time_point get_new_time(std::chrono::system_clock::time_point now) const override;
         Cron cron;
+
+        // cron tasks are not kept in the timer queue but in the scheduler's CronIndex,
+        // the tasks with the same schedule share a slot and member is the position in its group
+        CronIndex::slot slot;
+        std::size_t member;
     };
 
     inline bool try_parse(std::tm &tm, const std::string &expression, const std::string &format)
@@ -54,68 +209,111 @@ namespace secman
         return !(ss >> std::get_time(&tm, format.c_str())).fail();
     }
 
+    // "HH:MM:SS" (the next such time), "YYYY-MM-DD HH:MM:SS" or "YYYY/MM/DD HH:MM:SS" in local time
+    inline std::chrono::system_clock::time_point parse_time(const std::string &time)
+    {
+        // get current time as a tm object
+        auto time_now = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+        std::tm tm = *std::localtime(&time_now);
+
+        // our final time as a time_point
+        std::chrono::system_clock::time_point tp;
+
+        if (try_parse(tm, time, "%H:%M:%S"))
+        {
+            // convert tm back to time_t, then to a time_point and assign to final
+            tp = std::chrono::system_clock::from_time_t(std::mktime(&tm));
+
+            // if we've already passed this time, the user will mean next day, so add a day.
+            if (std::chrono::system_clock::now() >= tp)
+                tp += std::chrono::hours(24);
+        } else if (try_parse(tm, time, "%Y-%m-%d %H:%M:%S"))
+        {
+            tp = std::chrono::system_clock::from_time_t(std::mktime(&tm));
+        } else if (try_parse(tm, time, "%Y/%m/%d %H:%M:%S"))
+        {
+            tp = std::chrono::system_clock::from_time_t(std::mktime(&tm));
+        } else
+        {
+            // could not parse time
+            throw std::runtime_error("Cannot parse time string: " + time);
+        }
+        return tp;
+    }
+
+    struct SchedulerStats
+    {
+        std::size_t tasks;       // scheduled or running
+        std::size_t queued;      // waiting in the timer queue
+        std::size_t cron_tasks;
+        std::size_t cron_schedules;  // distinct schedules of the cron tasks
+        std::size_t running;         // runs that have not ended, including the ones whose task is gone
+        std::size_t skipped;         // runs dropped by their overlap policy or group limit
+        std::size_t throttled;       // runs waiting for a start rate limit
+        std::size_t delayed;         // runs waiting out their jitter
+        std::size_t wakeups;         // passes of the dispatcher
+        std::chrono::nanoseconds dispatcher_cpu;
+        // read from the pool, not the dispatcher
+        int threads = 0;
+        int idle_threads = 0;
+        std::size_t pool_queued = 0;     // runs waiting in the pool's queue
+        std::uint64_t pool_wakeups = 0;  // of idle threads of the pool
+    };
+
+    struct GroupStats
+    {
+        std::string name;
+        unsigned int limit;
+        unsigned int weight;
+        unsigned int running;  // runs that have not ended
+        unsigned int waiting;  // tasks with runs waiting for the limit
+        // the runs in the pool's queue, how many the pool took so far and how long they waited there
+        std::size_t queued;
+        std::uint64_t started;
+        std::chrono::nanoseconds mean_wait;
+        std::chrono::nanoseconds max_wait;
+    };
+
     class Scheduler
     {
+        friend class Run;
+
     public:
-        explicit Scheduler(unsigned int max_n_tasks = 4);
+        // with placement.per_node the runs of a task always go to the same node, so what it touches stays local.
+        // the dispatcher thread is pinned to placement.reserved_cpu if there is one
+        explicit Scheduler(unsigned int max_n_tasks = 4, TimerBackend backend = TimerBackend::timing_wheel,
+                           const tp::placement &placement = {});
 
         ~Scheduler();
 
         template<typename _Callable, typename... _Args>
-        void in(const std::chrono::system_clock::time_point time, _Callable &&f, _Args &&... args)
+        TaskId in(const std::chrono::system_clock::time_point time, _Callable &&f, _Args &&... args)
         {
             std::shared_ptr<Task> t = std::make_shared<InTask>(
                     std::bind(std::forward<_Callable>(f), std::forward<_Args>(args)...));
-            add_task(time, std::move(t));
+            return add_task(time, std::move(t));
         }
 
         template<typename _Callable, typename... _Args>
-        void in(const std::chrono::system_clock::duration time, _Callable &&f, _Args &&... args)
+        TaskId in(const std::chrono::system_clock::duration time, _Callable &&f, _Args &&... args)
         {
-            in(std::chrono::system_clock::now() + time, std::forward<_Callable>(f), std::forward<_Args>(args)...);
+            return in(std::chrono::system_clock::now() + time, std::forward<_Callable>(f), std::forward<_Args>(args)...);
         }
 
 
         template<typename _Callable, typename... _Args>
-        void at(const std::string &time, _Callable &&f, _Args &&... args)
+        TaskId at(const std::string &time, _Callable &&f, _Args &&... args)
         {
-            // get current time as a tm object
-            auto time_now = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
-            std::tm tm = *std::localtime(&time_now);
-
-            // our final time as a time_point
-            std::chrono::system_clock::time_point tp;
-
-            if (try_parse(tm, time, "%H:%M:%S"))
-            {
-                // convert tm back to time_t, then to a time_point and assign to final
-                tp = std::chrono::system_clock::from_time_t(std::mktime(&tm));
-
-                // if we've already passed this time, the user will mean next day, so add a day.
-                if (std::chrono::system_clock::now() >= tp)
-                    tp += std::chrono::hours(24);
-            } else if (try_parse(tm, time, "%Y-%m-%d %H:%M:%S"))
-            {
-                tp = std::chrono::system_clock::from_time_t(std::mktime(&tm));
-            } else if (try_parse(tm, time, "%Y/%m/%d %H:%M:%S"))
-            {
-                tp = std::chrono::system_clock::from_time_t(std::mktime(&tm));
-            } else
-            {
-                // could not parse time
-                throw std::runtime_error("Cannot parse time string: " + time);
-            }
-
-            in(tp, std::forward<_Callable>(f), std::forward<_Args>(args)...);
+            return in(parse_time(time), std::forward<_Callable>(f), std::forward<_Args>(args)...);
         }
 
         template<typename _Callable, typename... _Args>
-        void every(const std::chrono::system_clock::duration time, _Callable &&f, _Args &&... args)
+        TaskId every(const std::chrono::system_clock::duration time, _Callable &&f, _Args &&... args)
         {
             std::shared_ptr<Task> t = std::make_shared<EveryTask>(time, std::bind(std::forward<_Callable>(f),
                                                                                   std::forward<_Args>(args)...));
-            auto next_time = t->get_new_time();
-            add_task(next_time, std::move(t));
+            auto next_time = t->get_new_time(std::chrono::system_clock::now());
+            return add_task(next_time, std::move(t));
         }
 
 // expression format:
@@ -129,35 +327,228 @@ namespace secman
 //    │ │ │ │ │
 //    * * * * *
         template<typename _Callable, typename... _Args>
-        void cron(const std::string &expression, _Callable &&f, _Args &&... args)
+        TaskId cron(const std::string &expression, _Callable &&f, _Args &&... args)
         {
-            std::shared_ptr<Task> t = std::make_shared<CronTask>(expression, std::bind(std::forward<_Callable>(f),
-                                                                                       std::forward<_Args>(args)...));
-            auto next_time = t->get_new_time();
-            add_task(next_time, std::move(t));
+            auto t = std::make_shared<CronTask>(expression, std::bind(std::forward<_Callable>(f),
+                                                                      std::forward<_Args>(args)...));
+            // fails early on expressions that never match
+            t->get_new_time(std::chrono::system_clock::now());
+            return add_cron_task(std::move(t));
         }
 
         template<typename _Callable, typename... _Args>
-        void interval(const std::chrono::system_clock::duration time, _Callable &&f, _Args &&... args)
+        TaskId interval(const std::chrono::system_clock::duration time, _Callable &&f, _Args &&... args)
         {
             std::shared_ptr<Task> t = std::make_shared<EveryTask>(time, std::bind(std::forward<_Callable>(f),
                                                                                   std::forward<_Args>(args)...), true);
-            add_task(std::chrono::system_clock::now(), std::move(t));
+            return add_task(std::chrono::system_clock::now(), std::move(t));
         }
 
+        // the calls below are answered by the dispatcher thread and wait for it
+
+        // removes the task from the queue, a run that is already in progress is not interrupted
+        // returns false if there is no such task
+        bool cancel(TaskId id);
+        // cancels all of them in one pass of the dispatcher, returns how many there were
+        std::size_t cancel(const std::vector<TaskId> &ids);
+
+        // moves the next run of the task to time
+        // cron tasks can't be moved, they always run when the expression matches
+        bool reschedule(TaskId id, std::chrono::system_clock::time_point time);
+
+        std::optional<TaskInfo> lookup(TaskId id);
+
+        std::vector<TaskInfo> list();
+
+        SchedulerStats stats();
+
+        // takes effect from the next run, returns false if there is no such task
+        bool set_policy(TaskId id, RunPolicy policy);
+
+        // at most limit runs of the tasks in the group at once, 0 for no limit
+        void limit_group(const std::string &name, unsigned int limit);
+
+        // while the pool has a backlog the groups with runs waiting take turns, each starting up to weight runs in its turn.
+        // the runs without a group take part with weight 1
+        void set_group_weight(const std::string &name, unsigned int weight);
+
+        std::vector<GroupStats> group_stats();
+
+        // how late the runs of all tasks went to the pool, how long they waited there and how long they ran.
+        // each thread records to histograms of its own, this adds them up without asking the dispatcher
+        LatencyStats latency();
+        // same for the runs of one task since record_task_latency was turned on, nullopt if there is no such task
+        std::optional<LatencyStats> latency(TaskId id);
+        // of every task that has any
+        std::vector<std::pair<TaskId, LatencyStats>> task_latency();
+        // keeps histograms for each task from its next run on, some 17 KB per task that runs. off by default,
+        // turning it off again only stops more from being made
+        void record_task_latency(bool on);
+
+        // at most per_second runs start per second on average, and up to burst at once
+        // runs over the limit are started later in the order they came due. 0 for no limit, burst 0 for one second worth
+        void limit_rate(double per_second, double burst = 0);
+        // same for the runs of the tasks in the group, on top of the overall limit
+        void limit_group_rate(const std::string &name, double per_second, double burst = 0);
+
+        // for the tasks whose policy has no slack of its own, takes effect from their next run. 0 for none
+        void set_slack(std::chrono::milliseconds slack);
+
+        // the run of the job on this thread, empty outside of jobs
+        static std::shared_ptr<Run> current_run();
+
+        // an id for a task that is handed over with restore later
+        TaskId reserve_id();
+
+        // takes tasks that already have ids, like ones saved by an earlier run, all in one pass of the dispatcher
+        // the cron tasks go to the cron index and their time is not used, the others are queued at their time
+        // returns right away like the other adds
+        void restore(std::vector<TimerQueue::entry> saved);
+
+        // the worker threads, for one-off bulk work like parsing a crontab
+        tp::thread_pool& pool();
+
 
     private:
         std::atomic<bool> done;
 
         secman::InterruptableSleep sleeper;
 
-        std::multimap<std::chrono::system_clock::time_point, std::shared_ptr<Task>> tasks;
-        std::mutex lock;
+        // everything below up to the inbox is owned by the dispatcher thread,
+        // the other threads only talk to it through the inbox
+        std::unique_ptr<TimerQueue> tasks;
+        std::vector<TimerQueue::entry> expired;
+        // every task that has not finished or been cancelled, whether it is queued or running
+        std::unordered_map<TaskId, std::shared_ptr<Task>> index;
+        std::atomic<TaskId> last_id;
+
+        // all cron tasks are matched together once a minute
+        // each slot of the index is one distinct schedule, firing every task of its group
+        struct CronGroup
+        {
+            std::vector<std::shared_ptr<CronTask>> members;
+            // the next run as of a minute, worked out once for all members when they are listed
+            std::chrono::system_clock::time_point minute;
+            std::chrono::system_clock::time_point next;
+        };
+        CronIndex crons;
+        std::unordered_map<Cron, CronIndex::slot> schedules;
+        std::vector<CronGroup> cron_groups;  // by slot
+        std::size_t n_cron_tasks;
+        std::chrono::system_clock::time_point next_cron_tick;
+        std::vector<CronIndex::word> due;
+
+        // a run of a task on the pool
+        struct Job
+        {
+            // the job records its times there, and interval tasks are put back by the job once it is done
+            Scheduler *scheduler;
+            std::shared_ptr<Task> task;
+            std::shared_ptr<Run> run;
+            // when it was meant to start, the deadline on the pool
+            std::chrono::system_clock::time_point due;
+
+            void operator()(int) const;
+        };
+        // the jobs due in one pass, handed to the pool together
+        std::vector<Job> batch;
+
+        struct Request
+        {
+            enum class Kind { add, add_cron, rearm, call };
+
+            Kind kind;
+            std::shared_ptr<Task> task;
+            std::chrono::system_clock::time_point time;
+            // run on the dispatcher thread, used for the calls that need an answer
+            std::function<void()> call;
+        };
+        Inbox<Request> inbox;
+
+        std::shared_ptr<Run::Owner> owner;
+        std::unordered_map<std::string, std::shared_ptr<RunGroup>> groups;  // by name, dispatcher only
+        std::size_t n_skipped;
+
+        // runs held back before they go to the pool, dispatcher only:
+        // waiting out their jitter, waiting for a token of their group and then for one of the overall bucket
+        std::multimap<std::chrono::system_clock::time_point, Job> delayed;
+        std::unordered_map<RunGroup *, std::deque<Job>> group_throttled;
+        TokenBucket starts;
+        std::deque<Job> throttled;
+        std::size_t n_throttled;
+
+        std::chrono::milliseconds default_slack;
+        std::size_t n_wakeups;
+        bool task_latency_on;
+
+        // outlives the pool, whose threads record to it
+        PerThread<RunTimes> run_times;
+
         tp::thread_pool threads;
+        int dispatcher_cpu;
+
+        // sleeps in sleeper until the next task is due, the pool threads only run jobs
+        std::thread dispatcher;
+
+        TaskId add_task(const std::chrono::system_clock::time_point time, std::shared_ptr<Task> t);
+        TaskId add_cron_task(std::shared_ptr<CronTask> t);
+
+        // puts an interval task back after its run, unless it was cancelled or rescheduled meanwhile
+        void rearm(std::shared_ptr<Task> t);
+
+        std::chrono::system_clock::duration slack_of(const Task &t) const;
+        // puts the task in the timer queue at its due time rounded up to its slack, on the dispatcher thread
+        void enqueue(const std::shared_ptr<Task> &t, std::chrono::system_clock::time_point due);
 
-        void add_task(const std::chrono::system_clock::time_point time, std::shared_ptr<Task> t);
+        TaskInfo info_of(const Task &t);
+
+        void post(Request request);
+
+        // runs f on the dispatcher thread and returns its result
+        template<typename F>
+        auto ask(F &&f) -> decltype(f())
+        {
+            std::promise<decltype(f())> result;
+            auto answer = result.get_future();
+            post(Request{Request::Kind::call, nullptr, {}, [&result, &f]() { result.set_value(f()); }});
+            return answer.get();
+        }
+
+        void apply(Request &&request);
+
+        // takes the task out of the queue or the cron index, on the dispatcher thread
+        bool remove(TaskId id);
+
+        void add_to_group(const std::shared_ptr<CronTask> &task);
+        void remove_from_group(const CronTask &task);
+
+        // looks up the group named by the task's policy
+        void join_group(Task &task);
+        // the group of that name, made with a tenant of the pool when there is none yet
+        RunGroup &group_named(const std::string &name);
+        bool can_start(const Task &task) const;
+        // starts the queued runs of the task that fit in its limits now
+        void start_queued(const std::shared_ptr<Task> &task);
+        // called through the inbox when a run ends that has others waiting for it
+        void finished(const std::shared_ptr<Task> &task, const std::shared_ptr<RunGroup> &group);
+        void start(const std::shared_ptr<Task> &task, std::chrono::system_clock::time_point due);
+        // hands a run to the pool once the rate limits let it through
+        void release(Job &&job, std::chrono::system_clock::time_point now);
+        void release_global(Job &&job, std::chrono::system_clock::time_point now);
+        // releases the held back runs whose time has come
+        void release_held(std::chrono::system_clock::time_point now);
+
+        void dispatch_loop();
 
         void manage_tasks();
+
+        // runs the cron tasks due in the minutes since the last tick
+        void run_cron_ticks(std::chrono::system_clock::time_point now);
+
+        // starts a due run, or queues or drops it as the task's policy says
+        void dispatch(const std::shared_ptr<Task> &task, std::chrono::system_clock::time_point due);
+
+        std::chrono::system_clock::time_point next_wakeup();
     };
 }
 
@@ -0,0 +1,182 @@
+#include <algorithm>
+#include <cerrno>
+#include <system_error>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "supervisor.hpp"
+
+constexpr std::chrono::milliseconds secman::Supervisor::poll_interval;
+
+secman::Supervisor::Supervisor() : done(false), n_running(0)
+{
+    thread = std::thread([this]()
+                         {
+                             // the callbacks of the watched pidfds run inside sleep()
+                             while (!done)
+                             {
+                                 bool polling;
+                                 {
+                                     std::lock_guard<std::mutex> lg(m);
+                                     polling = !polled.empty();
+                                 }
+                                 if (!polling)
+                                 {
+                                     loop.sleep();
+                                     continue;
+                                 }
+                                 loop.sleep_for(poll_interval);
+                                 reap_polled();
+                             }
+                         });
+}
+
+secman::Supervisor::~Supervisor()
+{
+    done = true;
+    loop.interrupt();
+    thread.join();
+}
+
+pid_t secman::Supervisor::start(const ProcessRunner &runner, completion on_exit)
+{
+    pid_t pid = runner.spawn();
+    watch(pid, std::move(on_exit));
+    return pid;
+}
+
+pid_t secman::Supervisor::start(const ProcessRunner &runner, std::shared_ptr<JobLog> log, completion on_exit)
+{
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) == -1)
+        throw std::system_error(errno, std::generic_category(), "pipe2");
+    // only our end is non-blocking, the child blocks on a full pipe as usual
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    pid_t pid;
+    try
+    {
+        pid = runner.spawn(fds[1]);
+    }
+    catch (...)
+    {
+        close(fds[0]);
+        close(fds[1]);
+        throw;
+    }
+    close(fds[1]);
+    int pipe_fd = fds[0];
+    try
+    {
+        loop.watch(pipe_fd, [this, pipe_fd, log]() { capture(pipe_fd, *log); });
+    }
+    catch (...)
+    {
+        close(pipe_fd);  // the job is running, it goes without its log like when the file can't be opened
+    }
+    watch(pid, std::move(on_exit));
+    return pid;
+}
+
+void secman::Supervisor::watch(pid_t pid, completion on_exit)
+{
+    // a pidfd can be opened for a child that already exited as long as it was not reaped
+    int pidfd = static_cast<int>(syscall(SYS_pidfd_open, pid, 0));
+    ++n_running;
+    if (pidfd != -1)
+    {
+        try
+        {
+            loop.watch(pidfd, [this, pidfd, pid, on_exit]() { reap(pidfd, pid, on_exit); });
+            return;
+        }
+        catch (...)
+        {
+            close(pidfd);
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lg(m);
+        polled.emplace_back(pid, std::move(on_exit));
+    }
+    // the supervisor thread may be in an untimed sleep
+    loop.interrupt();
+}
+
+std::size_t secman::Supervisor::running() const
+{
+    return n_running;
+}
+
+void secman::Supervisor::reap(int pidfd, pid_t pid, const completion &on_exit)
+{
+    int status;
+    pid_t reaped;
+    do
+        reaped = waitpid(pid, &status, WNOHANG);
+    while (reaped == -1 && errno == EINTR);
+    if (reaped == 0)
+        return;
+    loop.unwatch(pidfd);
+    close(pidfd);
+    exited(pid, reaped, status, on_exit);
+}
+
+void secman::Supervisor::reap_polled()
+{
+    std::vector<std::pair<pid_t, completion>> children;
+    {
+        std::lock_guard<std::mutex> lg(m);
+        children.swap(polled);
+    }
+    // the ones still running go back, with the ones added in the meantime
+    auto running = std::remove_if(children.begin(), children.end(), [this](const std::pair<pid_t, completion> &child)
+    {
+        int status;
+        pid_t reaped;
+        do
+            reaped = waitpid(child.first, &status, WNOHANG);
+        while (reaped == -1 && errno == EINTR);
+        if (reaped == 0)
+            return false;
+        exited(child.first, reaped, status, child.second);
+        return true;
+    });
+    children.erase(running, children.end());
+    std::lock_guard<std::mutex> lg(m);
+    polled.insert(polled.end(), std::make_move_iterator(children.begin()), std::make_move_iterator(children.end()));
+}
+
+void secman::Supervisor::exited(pid_t pid, pid_t reaped, int status, const completion &on_exit)
+{
+    --n_running;
+    if (reaped == pid && on_exit)
+    {
+        try
+        {
+            on_exit(pid, status);
+        }
+        catch (...)
+        {
+            // like a task run on the pool, there is nobody to report it to
+        }
+    }
+}
+
+void secman::Supervisor::capture(int pipe_fd, JobLog &log)
+{
+    bool open;
+    try
+    {
+        open = log.drain(pipe_fd);
+    }
+    catch (...)
+    {
+        open = false;  // the log file can't be opened, the job gets SIGPIPE from now on
+    }
+    if (open)
+        return;
+    // end of file once the job and whatever it started have closed their copies
+    loop.unwatch(pipe_fd);
+    close(pipe_fd);
+}
@@ -0,0 +1,73 @@
+#ifndef SECMAN_SUPERVISOR_H
+#define SECMAN_SUPERVISOR_H
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <sys/types.h>
+
+#include "interruptable_sleep.hpp"
+#include "process_runner.hpp"
+#include "job_log.hpp"
+
+namespace secman
+{
+    // waits for child processes on one thread, so the pool threads that start them don't have to
+    // every child is watched through a pidfd in the epoll set of the supervisor's InterruptableSleep,
+    // when it exits it is reaped and its completion callback is called on the supervisor thread.
+    // children without a pidfd, on kernels before 5.3 or when out of fds, are polled with waitpid instead
+    class Supervisor
+    {
+    public:
+        // status is as reported by waitpid
+        using completion = std::function<void(pid_t pid, int status)>;
+
+        Supervisor();
+        Supervisor(const Supervisor &) = delete;
+        Supervisor& operator=(const Supervisor &) = delete;
+        // children still running are not waited for
+        ~Supervisor();
+
+        // starts the command and returns right away
+        pid_t start(const ProcessRunner &runner, completion on_exit);
+        // same, with the command's stdout and stderr captured into log
+        // the output is moved from a pipe on the supervisor thread, on_exit may be called before the last of it
+        pid_t start(const ProcessRunner &runner, std::shared_ptr<JobLog> log, completion on_exit);
+
+        // takes over an already started child, nothing else may wait for it. doesn't throw once the child is started
+        void watch(pid_t pid, completion on_exit);
+
+        // children started or watched that have not been reaped yet
+        std::size_t running() const;
+
+    private:
+        std::atomic<bool> done;
+        std::atomic<std::size_t> n_running;
+
+        InterruptableSleep loop;
+        std::thread thread;
+
+        // how often the children without a pidfd are checked on
+        static constexpr std::chrono::milliseconds poll_interval{100};
+
+        std::mutex m;
+        std::vector<std::pair<pid_t, completion>> polled;
+
+        // called when the pidfd is readable, the child may not have exited if the fd number was reused
+        void reap(int pidfd, pid_t pid, const completion &on_exit);
+        // reaps the polled children that exited
+        void reap_polled();
+        // reaped is what waitpid returned for pid, on_exit is only called if it is pid
+        void exited(pid_t pid, pid_t reaped, int status, const completion &on_exit);
+
+        // called when the read end of a job's output pipe is readable
+        void capture(int pipe_fd, JobLog &log);
+    };
+}
+
+#endif
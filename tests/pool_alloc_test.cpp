@@ -0,0 +1,123 @@
+// checks that posting to a warmed up pool doesn't allocate: the functors are stored in recycled tasks
+// and the injection queue is linked through them, see tp::thread_pool::post
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <thread>
+#include <vector>
+#include "tread_pool.hpp"
+
+namespace
+{
+    std::atomic<long> allocations{0};
+
+    constexpr int threads = 2;
+    constexpr int burst_size = 1000;
+
+    // a capture like the scheduler's jobs: a pointer and a shared_ptr
+    struct Job
+    {
+        std::atomic<long> *ran;
+        std::shared_ptr<int> shared;
+
+        void operator()(int) const
+        {
+            ran->fetch_add(1, std::memory_order_relaxed);
+        }
+    };
+
+    // posts a burst and waits until it ran and the workers are idle again, so the tasks are back on the free lists
+    template<typename Post>
+    void burst(tp::thread_pool &pool, std::atomic<long> &ran, Post &&post)
+    {
+        long target = ran + burst_size;
+        post();
+        while (ran < target || pool.n_idle() != threads)
+            std::this_thread::yield();
+    }
+
+    // fills the slab while the workers are held up, with room for a burst on top of the tasks the workers keep in
+    // their free lists, fewer than 256 each. the slab never shrinks, so after this posting takes recycled tasks only
+    void warm_up(tp::thread_pool &pool, const Job &job)
+    {
+        std::atomic<bool> hold{true};
+        std::atomic<int> held{0};
+        for (int i = 0; i < threads; ++i)
+            pool.post([&hold, &held](int)
+            {
+                ++held;
+                while (hold)
+                    std::this_thread::yield();
+            });
+        while (held != threads)
+            std::this_thread::yield();
+        long target = *job.ran + 2 * burst_size;
+        for (int i = 0; i < 2 * burst_size; ++i)
+            pool.post(job);
+        hold = false;
+        while (*job.ran < target || pool.n_idle() != threads)
+            std::this_thread::yield();
+    }
+
+    // allocations made while posting bursts, after a few of them to warm up
+    template<typename Post>
+    long allocations_of(tp::thread_pool &pool, std::atomic<long> &ran, Post &&post)
+    {
+        for (int i = 0; i < 10; ++i)
+            burst(pool, ran, post);
+        long before = allocations;
+        for (int i = 0; i < 200; ++i)
+            burst(pool, ran, post);
+        return allocations - before;
+    }
+}
+
+void *operator new(std::size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *p = std::malloc(size == 0 ? 1 : size))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+int main()
+{
+    tp::thread_pool pool(threads);
+    std::atomic<long> ran{0};
+    Job job{&ran, std::make_shared<int>(1)};
+    warm_up(pool, job);
+    int failed = 0;
+
+    auto posted = allocations_of(pool, ran, [&]()
+    {
+        for (int i = 0; i < burst_size; ++i)
+            pool.post(job);
+    });
+    std::printf("post: %ld allocations in 200 bursts of %d\n", posted, burst_size);
+    failed += posted != 0;
+
+    std::vector<Job> jobs(burst_size, job);
+    std::vector<Job> batch;
+    batch.reserve(burst_size);
+    auto batched = allocations_of(pool, ran, [&]()
+    {
+        batch.assign(jobs.begin(), jobs.end());
+        pool.post_batch(batch.begin(), batch.end());
+    });
+    std::printf("post_batch: %ld allocations in 200 bursts of %d\n", batched, burst_size);
+    failed += batched != 0;
+
+    return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,267 @@
+#include <algorithm>
+#include "timer_queue.hpp"
+
+namespace
+{
+    std::int64_t round_up(std::int64_t x, std::int64_t unit)
+    {
+        return (x + unit - 1) / unit * unit;
+    }
+
+    std::int64_t to_tick_floor(std::chrono::system_clock::time_point time)
+    {
+        return std::chrono::floor<std::chrono::milliseconds>(time.time_since_epoch()).count();
+    }
+
+    // rounding up makes sure a task is never reported before its time
+    std::int64_t to_tick_ceil(std::chrono::system_clock::time_point time)
+    {
+        return std::chrono::ceil<std::chrono::milliseconds>(time.time_since_epoch()).count();
+    }
+
+    std::chrono::system_clock::time_point from_tick(std::int64_t tick)
+    {
+        return std::chrono::system_clock::time_point(
+                std::chrono::duration_cast<std::chrono::system_clock::duration>(std::chrono::milliseconds(tick)));
+    }
+}
+
+std::unique_ptr<secman::TimerQueue> secman::make_timer_queue(secman::TimerBackend backend)
+{
+    if (backend == TimerBackend::multimap)
+        return std::make_unique<MultimapTimerQueue>();
+    return std::make_unique<TimingWheel>();
+}
+
+secman::TimerQueue::handle secman::MultimapTimerQueue::insert(time_point time, std::shared_ptr<Task> t)
+{
+    handle h;
+    if (free_handles.empty())
+    {
+        h = static_cast<handle>(positions.size());
+        positions.emplace_back();
+    }
+    else
+    {
+        h = free_handles.back();
+        free_handles.pop_back();
+    }
+    positions[h] = tasks.emplace(time, Item{std::move(t), h});
+    return h;
+}
+
+void secman::MultimapTimerQueue::erase(handle h)
+{
+    tasks.erase(positions[h]);
+    free_handles.push_back(h);
+}
+
+secman::TimerQueue::time_point secman::MultimapTimerQueue::time_of(handle h) const
+{
+    return positions[h]->first;
+}
+
+void secman::MultimapTimerQueue::pop_expired(time_point now, std::vector<entry> &out)
+{
+    auto end_of_expired = tasks.upper_bound(now);
+    for (auto i = tasks.begin(); i != end_of_expired; ++i)
+    {
+        out.emplace_back(i->first, std::move(i->second.task));
+        free_handles.push_back(i->second.h);
+    }
+    tasks.erase(tasks.begin(), end_of_expired);
+}
+
+secman::TimerQueue::time_point secman::MultimapTimerQueue::next_expiry() const
+{
+    return tasks.begin()->first;
+}
+
+bool secman::MultimapTimerQueue::empty() const
+{
+    return tasks.empty();
+}
+
+std::size_t secman::MultimapTimerQueue::size() const
+{
+    return tasks.size();
+}
+
+constexpr secman::TimerQueue::handle secman::TimerQueue::no_handle;
+constexpr std::int64_t secman::TimingWheel::unit[];
+constexpr std::uint32_t secman::TimingWheel::n_slots[];
+constexpr std::uint32_t secman::TimingWheel::first_bucket[];
+
+secman::TimingWheel::TimingWheel() : free_head(nil), heads(first_bucket[n_levels] + 1, nil), count(), n(0),
+                                     current(to_tick_floor(std::chrono::system_clock::now())) {}
+
+secman::TimerQueue::handle secman::TimingWheel::insert(time_point time, std::shared_ptr<Task> t)
+{
+    auto i = allocate();
+    auto &node = nodes[i];
+    node.tick = std::max(to_tick_ceil(time), current);
+    node.time = time;
+    node.task = std::move(t);
+    place(i);
+    ++n;
+    return i;
+}
+
+void secman::TimingWheel::erase(handle h)
+{
+    unlink(h);
+    release(h);
+    --n;
+}
+
+secman::TimerQueue::time_point secman::TimingWheel::time_of(handle h) const
+{
+    return nodes[h].time;
+}
+
+void secman::TimingWheel::pop_expired(time_point now, std::vector<entry> &out)
+{
+    auto target = to_tick_floor(now);
+    while (current <= target)
+    {
+        if (n == 0)
+        {
+            current = target + 1;
+            break;
+        }
+
+        // pull the slots that start at this tick one level down, from the top so they can fall through
+        for (int level = n_levels; level >= 1; --level)
+            if (current % unit[level] == 0)
+                cascade(level);
+
+        auto &head = heads[first_bucket[0] + current % n_slots[0]];
+        while (head != nil)
+        {
+            auto i = head;
+            out.emplace_back(nodes[i].time, std::move(nodes[i].task));
+            unlink(i);
+            release(i);
+            --n;
+        }
+
+        // nothing can expire before the next boundary of the lowest occupied level, jump straight to it
+        int level = 0;
+        while (level < n_levels && count[level] == 0)
+            ++level;
+        auto next = level == 0 ? current + 1 : round_up(current + 1, unit[level]);
+        current = std::min(next, target + 1);
+    }
+}
+
+secman::TimerQueue::time_point secman::TimingWheel::next_expiry() const
+{
+    // a higher level only yields the start of the slot, the wheel is then cascaded and asked again
+    // slots of higher levels are behind the ones of lower levels unless a cascade is pending at current
+    auto cascade_pending = current % unit[1] == 0;
+    auto earliest = round_up(current, unit[n_levels]);
+    bool found = false;
+    for (int level = 0; level < n_levels && (!found || cascade_pending); ++level)
+    {
+        if (count[level] == 0)
+            continue;
+        auto base = current / unit[level + 1] * unit[level + 1];
+        for (auto slot = static_cast<std::uint32_t>((current / unit[level]) % n_slots[level]); slot < n_slots[level]; ++slot)
+        {
+            if (heads[first_bucket[level] + slot] != nil)
+            {
+                earliest = std::min(earliest, std::max(base + slot * unit[level], current));
+                found = true;
+                break;
+            }
+        }
+    }
+    return from_tick(earliest);
+}
+
+bool secman::TimingWheel::empty() const
+{
+    return n == 0;
+}
+
+std::size_t secman::TimingWheel::size() const
+{
+    return n;
+}
+
+std::uint32_t secman::TimingWheel::allocate()
+{
+    if (free_head == nil)
+    {
+        nodes.emplace_back();
+        return static_cast<std::uint32_t>(nodes.size() - 1);
+    }
+    auto i = free_head;
+    free_head = nodes[i].next;
+    return i;
+}
+
+void secman::TimingWheel::release(std::uint32_t i)
+{
+    nodes[i].task.reset();
+    nodes[i].next = free_head;
+    free_head = i;
+}
+
+void secman::TimingWheel::place(std::uint32_t i)
+{
+    auto &node = nodes[i];
+    int level = 0;
+    while (level < n_levels && node.tick / unit[level + 1] != current / unit[level + 1])
+        ++level;
+
+    node.bucket = level == n_levels
+                  ? first_bucket[n_levels]
+                  : first_bucket[level] + static_cast<std::uint32_t>((node.tick / unit[level]) % n_slots[level]);
+
+    auto &head = heads[node.bucket];
+    node.prev = nil;
+    node.next = head;
+    if (head != nil)
+        nodes[head].prev = i;
+    head = i;
+    ++count[level];
+}
+
+void secman::TimingWheel::unlink(std::uint32_t i)
+{
+    auto &node = nodes[i];
+    if (node.prev != nil)
+        nodes[node.prev].next = node.next;
+    else
+        heads[node.bucket] = node.next;
+    if (node.next != nil)
+        nodes[node.next].prev = node.prev;
+    --count[level_of(node.bucket)];
+}
+
+void secman::TimingWheel::cascade(int level)
+{
+    auto bucket = level == n_levels
+                  ? first_bucket[n_levels]
+                  : first_bucket[level] + static_cast<std::uint32_t>((current / unit[level]) % n_slots[level]);
+
+    // detach the whole bucket first, overflow entries that are still far away are placed back into it
+    auto i = heads[bucket];
+    heads[bucket] = nil;
+    while (i != nil)
+    {
+        auto next = nodes[i].next;
+        --count[level];
+        place(i);
+        i = next;
+    }
+}
+
+int secman::TimingWheel::level_of(std::uint32_t bucket)
+{
+    int level = 0;
+    while (level < n_levels && bucket >= first_bucket[level + 1])
+        ++level;
+    return level;
+}
@@ -0,0 +1,136 @@
+#ifndef SECMAN_TIMER_QUEUE_H
+#define SECMAN_TIMER_QUEUE_H
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace secman
+{
+    class Task;
+
+    // ordered store of the pending tasks, keyed by the time they are due
+    class TimerQueue
+    {
+    public:
+        using time_point = std::chrono::system_clock::time_point;
+        using entry = std::pair<time_point, std::shared_ptr<Task>>;
+
+        // identifies a queued task until it expires or is erased, after that it may be reused
+        using handle = std::uint32_t;
+        static constexpr handle no_handle = UINT32_MAX;
+
+        virtual ~TimerQueue() = default;
+
+        virtual handle insert(time_point time, std::shared_ptr<Task> t) = 0;
+
+        // O(1) removal of a task that has not expired yet
+        virtual void erase(handle h) = 0;
+
+        virtual time_point time_of(handle h) const = 0;
+
+        // moves every task that is due at or before now to the end of out
+        virtual void pop_expired(time_point now, std::vector<entry> &out) = 0;
+
+        // earliest time at which pop_expired may return something, must not be called when empty
+        virtual time_point next_expiry() const = 0;
+
+        virtual bool empty() const = 0;
+        virtual std::size_t size() const = 0;
+    };
+
+    enum class TimerBackend
+    {
+        multimap,
+        timing_wheel
+    };
+
+    std::unique_ptr<TimerQueue> make_timer_queue(TimerBackend backend);
+
+    class MultimapTimerQueue : public TimerQueue
+    {
+    public:
+        handle insert(time_point time, std::shared_ptr<Task> t) override;
+        void erase(handle h) override;
+        time_point time_of(handle h) const override;
+        void pop_expired(time_point now, std::vector<entry> &out) override;
+        time_point next_expiry() const override;
+        bool empty() const override;
+        std::size_t size() const override;
+
+    private:
+        struct Item
+        {
+            std::shared_ptr<Task> task;
+            handle h;
+        };
+
+        std::multimap<time_point, Item> tasks;
+
+        // handle -> position in tasks, unused handles are kept for reuse
+        std::vector<std::multimap<time_point, Item>::iterator> positions;
+        std::vector<handle> free_handles;
+    };
+
+    // hierarchical timing wheel with millisecond resolution
+    // levels: 1000 x 1ms, 60 x 1s, 60 x 1min, 24 x 1h, anything further away waits in an overflow list
+    // a task sits in the lowest level whose current revolution contains its deadline
+    // and is cascaded one level down each time the wheel crosses the boundary of its slot
+    // nodes live in a slab and are recycled through a free list, so a warmed up wheel does not allocate
+    // the handle of a task is the index of its node
+    class TimingWheel : public TimerQueue
+    {
+    public:
+        TimingWheel();
+
+        handle insert(time_point time, std::shared_ptr<Task> t) override;
+        void erase(handle h) override;
+        time_point time_of(handle h) const override;
+        void pop_expired(time_point now, std::vector<entry> &out) override;
+        time_point next_expiry() const override;
+        bool empty() const override;
+        std::size_t size() const override;
+
+    private:
+        static constexpr int n_levels = 4;
+        static constexpr std::int64_t unit[n_levels + 1] = {1, 1000, 60 * 1000, 60 * 60 * 1000, 24 * 60 * 60 * 1000};
+        static constexpr std::uint32_t n_slots[n_levels] = {1000, 60, 60, 24};
+        // index of the first bucket of every level, the last one is the overflow list
+        static constexpr std::uint32_t first_bucket[n_levels + 1] = {0, 1000, 1060, 1120, 1144};
+        static constexpr std::uint32_t nil = no_handle;
+
+        struct Node
+        {
+            std::int64_t tick;
+            time_point time;
+            std::shared_ptr<Task> task;
+            std::uint32_t bucket;
+            std::uint32_t prev;
+            std::uint32_t next;
+        };
+
+        std::vector<Node> nodes;
+        std::uint32_t free_head;
+
+        std::vector<std::uint32_t> heads;
+        std::size_t count[n_levels + 1];
+        std::size_t n;
+
+        // first tick that has not been expired yet
+        std::int64_t current;
+
+        std::uint32_t allocate();
+        void release(std::uint32_t i);
+
+        void place(std::uint32_t i);
+        void unlink(std::uint32_t i);
+        void cascade(int level);
+
+        static int level_of(std::uint32_t bucket);
+    };
+}
+
+#endif
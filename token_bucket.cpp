@@ -0,0 +1,50 @@
+#include <algorithm>
+#include "token_bucket.hpp"
+
+secman::TokenBucket::TokenBucket(double rate, double burst) : rate(0), burst(1), tokens(1)
+{
+    set(rate, burst);
+}
+
+void secman::TokenBucket::set(double rate, double burst)
+{
+    this->rate = std::max(rate, 0.0);
+    this->burst = burst >= 1 ? burst : std::max(this->rate, 1.0);
+    tokens = this->burst;
+    last = time_point();
+}
+
+bool secman::TokenBucket::unlimited() const
+{
+    return rate == 0;
+}
+
+bool secman::TokenBucket::take(time_point now)
+{
+    if (unlimited())
+        return true;
+    refill(now);
+    if (tokens < 1)
+        return false;
+    tokens -= 1;
+    return true;
+}
+
+secman::TokenBucket::time_point secman::TokenBucket::next_token(time_point now)
+{
+    if (unlimited())
+        return now;
+    refill(now);
+    if (tokens >= 1)
+        return now;
+    auto wait = std::chrono::duration<double>((1 - tokens) / rate);
+    return now + std::chrono::ceil<std::chrono::system_clock::duration>(wait);
+}
+
+void secman::TokenBucket::refill(time_point now)
+{
+    // a clock going back adds nothing, the first call only starts the clock
+    if (last != time_point() && now > last)
+        tokens = std::min(burst, tokens + std::chrono::duration<double>(now - last).count() * rate);
+    last = std::max(last, now);
+}
@@ -0,0 +1,39 @@
+#ifndef SECMAN_TOKEN_BUCKET_H
+#define SECMAN_TOKEN_BUCKET_H
+
+#include <chrono>
+
+namespace secman
+{
+    // lets through rate events per second on average and up to burst of them at once
+    // not thread safe, the scheduler only uses it on the dispatcher thread
+    class TokenBucket
+    {
+    public:
+        using time_point = std::chrono::system_clock::time_point;
+
+        // a rate of 0 lets everything through
+        explicit TokenBucket(double rate = 0, double burst = 1);
+
+        // burst below 1 is one second worth of tokens, the bucket starts full
+        void set(double rate, double burst);
+
+        bool unlimited() const;
+
+        // takes a token if there is one
+        bool take(time_point now);
+
+        // when take will succeed again
+        time_point next_token(time_point now);
+
+    private:
+        double rate;
+        double burst;
+        double tokens;
+        time_point last;
+
+        void refill(time_point now);
+    };
+}
+
+#endif
@@ -1,10 +1,405 @@
-#include <tcpd.h>
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
 #include <future>
+#include <stdexcept>
+#include <dirent.h>
+#include <sched.h>
 #include "tread_pool.hpp"
 
-tp::thread_pool::thread_pool() : nWaiting(0), isStop(false), isDone(false) {}
+namespace
+{
+    // the first line of a sysfs file, empty if it can't be read
+    std::string read_line(const std::string &path)
+    {
+        std::ifstream in(path);
+        std::string line;
+        std::getline(in, line);
+        return line;
+    }
+}
+
+std::vector<int> tp::parse_cpu_list(const std::string &list)
+{
+    std::vector<int> cpus;
+    std::size_t i = 0;
+    auto number = [&]()
+    {
+        if (i >= list.size() || list[i] < '0' || list[i] > '9')
+            throw std::invalid_argument("bad cpu list: " + list);
+        int n = 0;
+        for (; i < list.size() && list[i] >= '0' && list[i] <= '9'; ++i)
+        {
+            n = n * 10 + (list[i] - '0');
+            if (n > 1 << 20)
+                throw std::invalid_argument("bad cpu list: " + list);
+        }
+        return n;
+    };
+    while (i < list.size() && list[i] != '\n')
+    {
+        int first = number(), last = first;
+        if (i < list.size() && list[i] == '-')
+        {
+            ++i;
+            last = number();
+            if (last < first)
+                throw std::invalid_argument("bad cpu list: " + list);
+        }
+        for (int cpu = first; cpu <= last; ++cpu)
+            cpus.push_back(cpu);
+        if (i < list.size() && list[i] == ',')
+            ++i;
+    }
+    return cpus;
+}
+
+std::vector<std::vector<int>> tp::numa_nodes(const std::string &root)
+{
+    std::vector<int> ids;
+    if (DIR *dir = opendir(root.c_str()))
+    {
+        while (dirent *entry = readdir(dir))
+        {
+            int id;
+            char rest;
+            if (std::sscanf(entry->d_name, "node%d%c", &id, &rest) == 1 && id >= 0)
+                ids.push_back(id);
+        }
+        closedir(dir);
+    }
+    std::sort(ids.begin(), ids.end());
+    std::vector<std::vector<int>> nodes;
+    for (int id : ids)
+    {
+        try
+        {
+            // nodes with memory and no cpus have an empty list
+            auto cpus = parse_cpu_list(read_line(root + "/node" + std::to_string(id) + "/cpulist"));
+            if (!cpus.empty())
+                nodes.push_back(std::move(cpus));
+        }
+        catch (const std::invalid_argument &)
+        {
+        }
+    }
+    if (nodes.empty())
+    {
+        std::vector<int> cpus;
+        try
+        {
+            cpus = parse_cpu_list(read_line("/sys/devices/system/cpu/online"));
+        }
+        catch (const std::invalid_argument &)
+        {
+        }
+        if (cpus.empty())
+            for (int cpu = 0; cpu < static_cast<int>(std::max(1u, std::thread::hardware_concurrency())); ++cpu)
+                cpus.push_back(cpu);
+        nodes.push_back(std::move(cpus));
+    }
+    return nodes;
+}
+
+bool tp::pin_current_thread(const std::vector<int> &cpus)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    bool any = false;
+    for (int cpu : cpus)
+        if (cpu >= 0 && cpu < CPU_SETSIZE)
+        {
+            CPU_SET(cpu, &set);
+            any = true;
+        }
+    return any && sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+void tp::detail::Task::reset()
+{
+    this->taken = 0;
+    if (this->ops)
+    {
+        this->ops->destroy(this->storage);
+        this->ops = nullptr;
+    }
+}
+
+bool tp::detail::RankedQueue::after(const Entry &a, const Entry &b)
+{
+    return a.rank != b.rank ? a.rank > b.rank : a.sequence > b.sequence;
+}
+
+void tp::detail::RankedQueue::push(Task *t)
+{
+    ++this->n;
+    t->sequence = this->pushed++;
+    if (t->rank == Task::unranked)
+        t->rank = this->back;
+    this->back = std::max(this->back, t->rank);
+    if (!this->tail || t->rank >= this->tail->rank)
+    {
+        t->next = nullptr;
+        if (this->tail)
+            this->tail->next = t;
+        else
+            this->head = t;
+        this->tail = t;
+    }
+    else
+    {
+        this->heap.push_back({t->rank, t->sequence, t});
+        std::push_heap(this->heap.begin(), this->heap.end(), after);
+    }
+}
+
+bool tp::detail::RankedQueue::pop(Task *&t)
+{
+    if (!this->heap.empty() && (!this->head || after({this->head->rank, this->head->sequence, this->head}, this->heap.front())))
+    {
+        std::pop_heap(this->heap.begin(), this->heap.end(), after);
+        t = this->heap.back().task;
+        this->heap.pop_back();
+    }
+    else if (this->head)
+    {
+        t = this->head;
+        this->head = t->next;
+        if (!this->head)
+            this->tail = nullptr;
+    }
+    else
+        return false;
+    --this->n;
+    if (this->empty())
+        this->back = Task::unranked;
+    return true;
+}
+
+tp::detail::TaskQueue::TaskQueue(std::shared_ptr<TenantLimit> limit)
+{
+    this->tenants.emplace_back(new Tenant());
+    this->tenants.back()->limit = std::move(limit);
+}
+
+std::size_t tp::detail::TaskQueue::push(Task *t)
+{
+    return this->push(t, t);
+}
+
+std::size_t tp::detail::TaskQueue::push(Task *first, Task *last)
+{
+    last->next = nullptr;
+    std::unique_lock<std::mutex> lock(this->mutex);
+    for (Task * t = first, * next; t; t = next)
+    {
+        next = t->next;
+        auto i = static_cast<std::size_t>(t->tenant);
+        Tenant * tenant = i < this->tenants.size() ? this->tenants[i].get() : this->tenants[0].get();
+        tenant->queue.push(t);
+        ++this->queued;
+        if (!tenant->active)
+        {
+            // joins the round at the end, with a fresh turn
+            tenant->active = true;
+            tenant->deficit = 0;
+            this->round.push_back(tenant);
+        }
+    }
+    return this->queued;
+}
+
+bool tp::detail::TaskQueue::pop(Task *&t, bool ignore_caps, std::size_t keep)
+{
+    std::unique_lock<std::mutex> lock(this->mutex);
+    if (this->queued <= keep)
+        return false;
+    for (std::size_t passed = 0; passed < this->round.size(); ++passed, ++this->turn)
+    {
+        if (this->turn >= this->round.size())
+            this->turn = 0;
+        Tenant * tenant = this->round[this->turn];
+        TenantLimit & limit = *tenant->limit;
+        auto cap = limit.max_running.load(std::memory_order_relaxed);
+        if (!ignore_caps && cap != 0 && limit.running >= cap)
+            continue;
+        if (tenant->deficit == 0)
+            tenant->deficit = tenant->weight;
+        tenant->queue.pop(t);
+        --tenant->deficit;
+        ++tenant->started;
+        --this->queued;
+        ++this->taken;
+        // the default tenant is the fast path, its running functors are only counted for a cap
+        t->counted = nullptr;
+        if (cap != 0 || tenant != this->tenants[0].get())
+        {
+            ++limit.running;
+            t->counted = &limit;
+        }
+        if (tenant->queue.empty())
+        {
+            tenant->active = false;
+            this->round.erase(this->round.begin() + static_cast<std::ptrdiff_t>(this->turn));
+        }
+        else if (tenant->deficit == 0)
+            ++this->turn;
+        lock.unlock();
+
+        if (t->posted != 0)
+        {
+            t->taken = std::chrono::steady_clock::now().time_since_epoch().count();
+            auto wait = t->taken - t->posted;
+            tenant->timed.fetch_add(1, std::memory_order_relaxed);
+            tenant->total_wait.fetch_add(wait, std::memory_order_relaxed);
+            auto longest = tenant->max_wait.load(std::memory_order_relaxed);
+            while (wait > longest && !tenant->max_wait.compare_exchange_weak(longest, wait, std::memory_order_relaxed));
+        }
+        return true;
+    }
+    return false;
+}
+
+void tp::detail::TaskQueue::counts(std::size_t &queued, std::uint64_t &taken)
+{
+    std::unique_lock<std::mutex> lock(this->mutex);
+    queued = this->queued;
+    taken = this->taken;
+}
+
+bool tp::detail::TaskQueue::empty()
+{
+    std::unique_lock<std::mutex> lock(this->mutex);
+    return this->round.empty();
+}
+
+int tp::detail::TaskQueue::add_tenant(unsigned int weight, std::shared_ptr<TenantLimit> limit)
+{
+    std::unique_lock<std::mutex> lock(this->mutex);
+    this->tenants.emplace_back(new Tenant());
+    this->tenants.back()->weight = std::max(weight, 1u);
+    this->tenants.back()->limit = std::move(limit);
+    return static_cast<int>(this->tenants.size() - 1);
+}
+
+void tp::detail::TaskQueue::set_weight(int tenant, unsigned int weight)
+{
+    std::unique_lock<std::mutex> lock(this->mutex);
+    if (tenant < 0 || static_cast<std::size_t>(tenant) >= this->tenants.size())
+        return;
+    this->tenants[static_cast<std::size_t>(tenant)]->weight = std::max(weight, 1u);
+}
+
+std::vector<tp::tenant_stats> tp::detail::TaskQueue::stats()
+{
+    std::unique_lock<std::mutex> lock(this->mutex);
+    std::vector<tenant_stats> result;
+    result.reserve(this->tenants.size());
+    for (auto &t : this->tenants)
+    {
+        auto timed = t->timed.load(std::memory_order_relaxed);
+        auto total = t->total_wait.load(std::memory_order_relaxed);
+        result.push_back({t->weight, t->limit->max_running.load(), t->queue.size(), t->limit->running.load(), t->started,
+                          std::chrono::nanoseconds(std::chrono::steady_clock::duration(timed ? total / static_cast<std::int64_t>(timed) : 0)),
+                          std::chrono::nanoseconds(std::chrono::steady_clock::duration(t->max_wait.load(std::memory_order_relaxed)))});
+    }
+    return result;
+}
+
+tp::detail::Task *tp::detail::TaskSlab::acquire()
+{
+    return this->acquire(1);
+}
+
+tp::detail::Task *tp::detail::TaskSlab::acquire(int n)
+{
+    std::unique_lock<std::mutex> lock(this->mutex);
+    Task * first = nullptr;
+    Task ** link = &first;
+    for (int i = 0; i < n; ++i)
+    {
+        if (!this->free)
+        {
+            this->blocks.emplace_back(new Task[block_size]);
+            Task * block = this->blocks.back().get();
+            for (int j = 0; j < block_size - 1; ++j)
+                block[j].next = &block[j + 1];
+            this->free = block;
+        }
+        *link = this->free;
+        link = &this->free->next;
+        this->free = this->free->next;
+    }
+    *link = nullptr;
+    return first;
+}
+
+void tp::detail::TaskSlab::release(Task *first, Task *last)
+{
+    std::unique_lock<std::mutex> lock(this->mutex);
+    last->next = this->free;
+    this->free = first;
+}
 
-tp::thread_pool::thread_pool(int nThreads) : nWaiting(0), isStop(false), isDone(false) { this->resize(nThreads); }
+constexpr int tp::thread_pool::max_free_per_worker;
+
+thread_local tp::thread_pool * tp::thread_pool::local_pool = nullptr;
+thread_local tp::thread_pool::worker * tp::thread_pool::local_worker = nullptr;
+thread_local tp::detail::Task * tp::thread_pool::local_task = nullptr;
+
+tp::thread_pool::thread_pool() : workers(std::make_shared<worker_list>()), nWorkers(0), nodeCpus(1), isDone(false), isStop(false), nWaiting(0),
+                                 aging(std::chrono::system_clock::duration(std::chrono::seconds(1)).count())
+{
+    this->limits.push_back(std::make_shared<detail::TenantLimit>());
+    this->queues.emplace_back(new detail::TaskQueue(this->limits[0]));
+    this->perNode.emplace_back(new node_workers());
+}
+
+tp::thread_pool::thread_pool(int nThreads) : thread_pool() { this->resize(nThreads); }
+
+tp::thread_pool::thread_pool(int nThreads, const placement &where) : thread_pool()
+{
+    auto topology = where.nodes.empty() ? numa_nodes() : where.nodes;
+    auto allowed = [&where](int cpu)
+    {
+        return cpu != where.reserved_cpu && (where.cpus.empty() || std::find(where.cpus.begin(), where.cpus.end(), cpu) != where.cpus.end());
+    };
+    int max_cpu = -1;
+    for (auto &node : topology)
+        for (int cpu : node)
+            max_cpu = std::max(max_cpu, cpu);
+    // the callers on cpus outside of the nodes kept go to the first one
+    this->nodeOfCpu.assign(static_cast<std::size_t>(max_cpu + 1), 0);
+
+    if (where.per_node)
+    {
+        this->nodeCpus.clear();
+        for (auto &node : topology)
+        {
+            std::vector<int> cpus;
+            std::copy_if(node.begin(), node.end(), std::back_inserter(cpus), allowed);
+            if (cpus.empty())
+                continue;  // no worker goes there
+            for (int cpu : node)
+                if (cpu >= 0)
+                    this->nodeOfCpu[static_cast<std::size_t>(cpu)] = static_cast<int>(this->nodeCpus.size());
+            this->nodeCpus.push_back(std::move(cpus));
+        }
+        if (this->nodeCpus.empty())
+            this->nodeCpus.resize(1);
+        while (this->queues.size() < this->nodeCpus.size())
+        {
+            this->queues.emplace_back(new detail::TaskQueue(this->limits[0]));
+            this->perNode.emplace_back(new node_workers());
+        }
+    }
+    else if (!where.cpus.empty() || where.reserved_cpu >= 0)
+    {
+        for (auto &node : topology)
+            std::copy_if(node.begin(), node.end(), std::back_inserter(this->nodeCpus[0]), allowed);
+    }
+    this->resize(nThreads);
+}
 
 tp::thread_pool::~thread_pool()
 {
@@ -13,7 +408,7 @@ tp::thread_pool::~thread_pool()
 
 int tp::thread_pool::size()
 {
-    return static_cast<int>(this->threads.size());
+    return this->nWorkers;
 }
 
 int tp::thread_pool::n_idle()
@@ -21,6 +416,19 @@ int tp::thread_pool::n_idle()
     return this->nWaiting;
 }
 
+std::size_t tp::thread_pool::n_queued()
+{
+    std::size_t queued;
+    std::uint64_t taken;
+    this->counts(queued, taken);
+    return queued;
+}
+
+std::uint64_t tp::thread_pool::n_wakeups()
+{
+    return this->nWakeups.load(std::memory_order_relaxed);
+}
+
 std::thread &tp::thread_pool::get_thread(int i)
 {
     return *this->threads[i];
@@ -28,66 +436,291 @@ std::thread &tp::thread_pool::get_thread(int i)
 
 void tp::thread_pool::resize(int nThreads)
 {
+    std::unique_lock<std::mutex> guard(this->resizing);
+    this->reap();
     if (!this->isStop && !this->isDone)
     {
         int oldNThreads = static_cast<int>(this->threads.size());
+        auto resized = std::make_shared<worker_list>(*this->workers);
         if (oldNThreads <= nThreads)
         {  // if the number of threads is increased
             this->threads.resize(nThreads);
-            this->flags.resize(nThreads);
-
             for (int i = oldNThreads; i < nThreads; ++i)
             {
-                this->flags[i] = std::make_shared<std::atomic<bool>>(false);
-                this->set_thread(i);
+                // spread round robin over the nodes
+                auto w = std::make_shared<worker>();
+                w->node = i % static_cast<int>(this->nodeCpus.size());
+                w->cpus = this->nodeCpus[static_cast<std::size_t>(w->node)];
+                ++this->perNode[static_cast<std::size_t>(w->node)]->n;
+                resized->push_back(std::move(w));
             }
+            std::atomic_store(&this->workers, std::shared_ptr<const worker_list>(resized));
+
+            for (int i = oldNThreads; i < nThreads; ++i)
+                this->set_thread(i);
         }
         else
         {  // the number of threads is decreased
             for (int i = oldNThreads - 1; i >= nThreads; --i)
             {
-                *this->flags[i] = true;  // this thread will finish
-                this->threads[i]->detach();
+                (*resized)[i]->flag = true;  // this thread will finish
+                --this->perNode[static_cast<std::size_t>((*resized)[i]->node)]->n;
+                this->retired.emplace_back(std::move(this->threads[i]), (*resized)[i]);
             }
             {
-                // stop the detached threads that were waiting
+                // stop the retired threads that were waiting
                 std::unique_lock<std::mutex> lock(this->mutex);
-                this->cv.notify_all();
+                this->notify_all();
             }
-            this->threads.resize(nThreads);  // safe to delete because the threads are detached
-            this->flags.resize(nThreads);  // safe to delete because the threads have copies of shared_ptr of the flags, not originals
+            this->threads.resize(nThreads);
+            // safe to drop because the threads have copies of shared_ptr of their workers, as have running thieves
+            resized->resize(nThreads);
+            std::atomic_store(&this->workers, std::shared_ptr<const worker_list>(resized));
         }
+        this->nWorkers = nThreads;
+    }
+}
+
+void tp::thread_pool::reap()
+{
+    auto exited = std::partition(this->retired.begin(), this->retired.end(),
+                                 [](const std::pair<std::unique_ptr<std::thread>, std::shared_ptr<worker>> &r) { return !r.second->exited; });
+    for (auto i = exited; i != this->retired.end(); ++i)
+        i->first->join();
+    this->retired.erase(exited, this->retired.end());
+}
+
+void tp::thread_pool::autoscale(int min_threads, int max_threads, std::chrono::milliseconds wait, std::chrono::milliseconds cooldown)
+{
+    this->stop_scaling();
+    if (max_threads <= 0)
+        return;
+    min_threads = std::max(0, std::min(min_threads, max_threads));
+    this->resize(std::min(std::max(this->size(), min_threads), max_threads));
+    {
+        std::unique_lock<std::mutex> lock(this->scaleMutex);
+        this->scaleStop = false;
+    }
+    this->scaler = std::thread([=]() { this->scale(min_threads, max_threads, wait, cooldown); });
+}
+
+void tp::thread_pool::scale(int min_threads, int max_threads, std::chrono::milliseconds wait, std::chrono::milliseconds cooldown)
+{
+    // the functors that were queued at the last look and are still there have waited at least a whole period.
+    // workers idle at every look through the cooldown are taken away
+    std::size_t queued = 0;
+    std::uint64_t taken = 0;
+    this->counts(queued, taken);
+    int least_idle = INT32_MAX;
+    auto since = std::chrono::steady_clock::now();
+    std::unique_lock<std::mutex> lock(this->scaleMutex);
+    while (!this->scaleStop)
+    {
+        if (queued == 0 && this->size() <= min_threads)
+        {
+            // nothing to grow for or to take away until more functors come than there are idle workers.
+            // parked is set before the queue is looked at again, notify looks at them the other way round
+            this->parked = true;
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            lock.unlock();
+            this->counts(queued, taken);
+            lock.lock();
+            if (queued == 0)
+                this->scaleCv.wait(lock, [this]() { return this->scaleStop || !this->parked; });
+            this->parked = false;
+            least_idle = INT32_MAX;
+            since = std::chrono::steady_clock::now();
+        }
+        else
+            this->scaleCv.wait_for(lock, wait, [this]() { return this->scaleStop; });
+        if (this->scaleStop)
+            break;
+        lock.unlock();
+
+        auto was_queued = queued;
+        auto was_taken = taken;
+        this->counts(queued, taken);
+        auto stale = taken - was_taken < was_queued ? was_queued - (taken - was_taken) : 0;
+        int size = this->size();
+        auto now = std::chrono::steady_clock::now();
+        if (stale > 0 && this->nWaiting == 0 && size < max_threads)
+        {
+            // at most doubles at a time
+            int more = static_cast<int>(std::min<std::size_t>(stale, static_cast<std::size_t>(std::max(size, 1))));
+            this->resize(std::min(max_threads, size + more));
+            least_idle = INT32_MAX;
+            since = now;
+        }
+        else
+        {
+            least_idle = std::min(least_idle, this->nWaiting.load());
+            if (now - since >= cooldown)
+            {
+                if (least_idle > 0 && size > min_threads)
+                    this->resize(std::max(min_threads, size - least_idle));
+                least_idle = INT32_MAX;
+                since = now;
+            }
+        }
+        lock.lock();
+    }
+}
+
+void tp::thread_pool::stop_scaling()
+{
+    {
+        std::unique_lock<std::mutex> lock(this->scaleMutex);
+        this->scaleStop = true;
+        this->scaleCv.notify_all();
+    }
+    if (this->scaler.joinable())
+        this->scaler.join();
+}
+
+void tp::thread_pool::wake_scaler()
+{
+    std::unique_lock<std::mutex> lock(this->scaleMutex);
+    this->parked = false;
+    this->scaleCv.notify_all();
+}
+
+void tp::thread_pool::set_aging(std::chrono::system_clock::duration aging)
+{
+    this->aging = aging.count();
+}
+
+std::int64_t tp::thread_pool::rank_of(urgency u) const
+{
+    return u.deadline.time_since_epoch().count() - static_cast<std::int64_t>(u.priority) * this->aging.load(std::memory_order_relaxed);
+}
+
+int tp::thread_pool::add_tenant(unsigned int weight, unsigned int max_running)
+{
+    std::unique_lock<std::mutex> lock(this->tenantsMutex);
+    this->limits.push_back(std::make_shared<detail::TenantLimit>());
+    this->limits.back()->max_running = max_running;
+    int tenant = 0;
+    for (auto &queue : this->queues)
+        tenant = queue->add_tenant(weight, this->limits.back());
+    return tenant;
+}
+
+void tp::thread_pool::set_tenant(int tenant, unsigned int weight, unsigned int max_running)
+{
+    {
+        std::unique_lock<std::mutex> lock(this->tenantsMutex);
+        if (tenant < 0 || static_cast<std::size_t>(tenant) >= this->limits.size())
+            return;
+        this->limits[static_cast<std::size_t>(tenant)]->max_running = max_running;
+        for (auto &queue : this->queues)
+            queue->set_weight(tenant, weight);
+    }
+    // a higher cap may let functors go that the idle workers passed over
+    this->notify(this->size());
+}
+
+std::vector<tp::tenant_stats> tp::thread_pool::tenants()
+{
+    auto result = this->queues[0]->stats();
+    for (std::size_t i = 1; i < this->queues.size(); ++i)
+    {
+        auto more = this->queues[i]->stats();
+        for (std::size_t t = 0; t < result.size() && t < more.size(); ++t)
+        {
+            auto &s = result[t];
+            auto &m = more[t];
+            // the mean of the means, weighted by the functors started from each queue
+            auto started = s.started + m.started;
+            if (started != 0)
+                s.mean_wait = std::chrono::nanoseconds((s.mean_wait.count() * static_cast<std::int64_t>(s.started) +
+                                                        m.mean_wait.count() * static_cast<std::int64_t>(m.started)) / static_cast<std::int64_t>(started));
+            s.queued += m.queued;
+            s.started = started;
+            s.max_wait = std::max(s.max_wait, m.max_wait);
+        }
+    }
+    return result;
+}
+
+bool tp::thread_pool::current_times(std::chrono::steady_clock::time_point &posted, std::chrono::steady_clock::time_point &taken)
+{
+    if (!local_task || local_task->taken == 0)
+        return false;
+    posted = std::chrono::steady_clock::time_point(std::chrono::steady_clock::duration(local_task->posted));
+    taken = std::chrono::steady_clock::time_point(std::chrono::steady_clock::duration(local_task->taken));
+    return true;
+}
+
+int tp::thread_pool::nodes() const
+{
+    return static_cast<int>(this->queues.size());
+}
+
+std::size_t tp::thread_pool::queue_of(int node)
+{
+    if (this->queues.size() == 1)
+        return 0;
+    if (node < 0)
+    {
+        int cpu = sched_getcpu();
+        node = cpu >= 0 && static_cast<std::size_t>(cpu) < this->nodeOfCpu.size() ? this->nodeOfCpu[static_cast<std::size_t>(cpu)] : 0;
+    }
+    return static_cast<std::size_t>(node) % this->queues.size();
+}
+
+void tp::thread_pool::counts(std::size_t &queued, std::uint64_t &taken)
+{
+    queued = 0;
+    taken = 0;
+    for (auto &queue : this->queues)
+    {
+        std::size_t q;
+        std::uint64_t t;
+        queue->counts(q, t);
+        queued += q;
+        taken += t;
     }
 }
 
 void tp::thread_pool::clear_queue()
 {
-    std::function<void(int id)> * _f;
-    while (this->q.pop(_f))
-        delete _f; // empty the queue
+    detail::Task * _t;
+    for (auto &queue : this->queues)
+        while (queue->pop(_t, true))
+        {
+            this->done(_t);
+            this->release(_t); // empty the queue
+        }
+    for (auto &w : *std::atomic_load(&this->workers))
+        while (w->deque.steal(_t))
+            this->release(_t);
 }
 
 std::function<void(int)> tp::thread_pool::pop()
 {
-    std::function<void(int id)> * _f = nullptr;
-    this->q.pop(_f);
-    std::unique_ptr<std::function<void(int id)>> func(_f); // at return, delete the function even if an exception occurred
-    std::function<void(int)> f;
-    if (_f)
-        f = *_f;
-    return f;
+    detail::Task * _t = nullptr;
+    auto queue = std::find_if(this->queues.begin(), this->queues.end(),
+                              [&_t](const std::unique_ptr<detail::TaskQueue> &q) { return q->pop(_t); });
+    if (queue == this->queues.end())
+        return std::function<void(int)>();
+    // the task goes back to the slab once the last copy of the wrapper is gone
+    std::shared_ptr<detail::Task> t(_t, [this](detail::Task * t) { this->done(t); this->release(t); });
+    return [t](int id) { (*t)(id); };
 }
 
 void tp::thread_pool::stop(bool isWait)
 {
+    // the controller resizes, it is stopped before the threads are
+    this->stop_scaling();
+    std::unique_lock<std::mutex> guard(this->resizing);
     if (!isWait)
     {
         if (this->isStop)
             return;
         this->isStop = true;
-        for (int i = 0, n = this->size(); i < n; ++i)
+        for (auto &w : *std::atomic_load(&this->workers))
         {
-            *this->flags[i] = true;  // command the threads to stop
+            w->flag = true;  // command the threads to stop
         }
         this->clear_queue();  // empty the queue
     }
@@ -99,46 +732,334 @@ void tp::thread_pool::stop(bool isWait)
     }
     {
         std::unique_lock<std::mutex> lock(this->mutex);
-        this->cv.notify_all();  // stop all waiting threads
+        this->notify_all();  // stop all waiting threads
     }
     for (int i = 0; i < static_cast<int>(this->threads.size()); ++i)
     {  // wait for the computing threads to finish
         if (this->threads[i]->joinable())
             this->threads[i]->join();
     }
+    for (auto &r : this->retired)
+        r.first->join();
+    this->retired.clear();
+    this->nWorkers = 0;
+    for (auto &node : this->perNode)
+        node->n = 0;
     // if there were no threads in the pool but some functors in the queue, the functors are not deleted by the threads
     // therefore delete them here
     this->clear_queue();
     this->threads.clear();
-    this->flags.clear();
+    std::atomic_store(&this->workers, std::shared_ptr<const worker_list>(std::make_shared<worker_list>()));
+}
+
+tp::detail::Task *tp::thread_pool::acquire()
+{
+    if (local_pool == this && local_worker->free)
+    {
+        detail::Task * t = local_worker->free;
+        local_worker->free = t->next;
+        --local_worker->nFree;
+        return t;
+    }
+    return this->slab.acquire();
+}
+
+tp::detail::Task *tp::thread_pool::acquire(int n)
+{
+    if (local_pool != this)
+        return this->slab.acquire(n);
+    detail::Task * first = nullptr;
+    detail::Task ** link = &first;
+    for (int i = 0; i < n; ++i)
+    {
+        *link = this->acquire();
+        link = &(*link)->next;
+    }
+    *link = nullptr;
+    return first;
+}
+
+void tp::thread_pool::release(detail::Task *t)
+{
+    t->reset();
+    if (local_pool != this)
+    {
+        this->slab.release(t, t);
+        return;
+    }
+    worker & self = *local_worker;
+    t->next = self.free;
+    self.free = t;
+    if (++self.nFree < 2 * max_free_per_worker)
+        return;
+    // keep max_free_per_worker tasks and give the rest back in one go
+    detail::Task * last = self.free;
+    for (int i = 1; i < max_free_per_worker; ++i)
+        last = last->next;
+    self.free = last->next;
+    self.nFree -= max_free_per_worker;
+    this->slab.release(t, last);
+}
+
+void tp::thread_pool::enqueue(detail::Task *t)
+{
+    if (local_pool == this && !local_worker->flag)
+    {
+        local_worker->deque.push(t);
+        this->notify(1, local_worker->node, this->spill(local_worker->node));
+    }
+    else if (this->queues.size() == 1)
+    {
+        this->queues[0]->push(t);
+        this->notify(1);
+    }
+    else
+    {
+        auto i = this->queue_of(t->node);
+        auto queued = this->queues[i]->push(t);
+        this->notify(1, static_cast<int>(i), this->spill(static_cast<int>(i), queued));
+    }
+}
+
+void tp::thread_pool::enqueue(detail::Task *first, detail::Task *last, int n)
+{
+    if (local_pool == this && !local_worker->flag)
+    {
+        // the link is read before the push, a thief may run and recycle a pushed task right away
+        for (detail::Task * t = first, * next; t; t = next)
+        {
+            next = t->next;
+            local_worker->deque.push(t);
+        }
+        this->notify(n, local_worker->node, n * this->spill(local_worker->node));
+    }
+    else if (this->queues.size() == 1)
+    {
+        this->queues[0]->push(first, last);
+        this->notify(n);
+    }
+    else
+    {
+        // every node wakes its own workers for its part of the batch
+        std::vector<std::pair<int, std::size_t>> per_node(this->queues.size());  // pushed and queued after
+        for (detail::Task * t = first, * next; t; t = next)
+        {
+            next = t->next;
+            auto i = this->queue_of(t->node);
+            per_node[i].second = this->queues[i]->push(t);
+            ++per_node[i].first;
+        }
+        for (std::size_t i = 0; i < per_node.size(); ++i)
+            if (per_node[i].first != 0)
+                this->notify(per_node[i].first, static_cast<int>(i),
+                             std::min(per_node[i].first, this->spill(static_cast<int>(i), per_node[i].second)));
+    }
+}
+
+void tp::thread_pool::notify(int n, int node, int others)
+{
+    // pairs with the increment of nWaiting in set_thread: either the waiting worker sees the functor
+    // when it checks the queues, or we see it waiting and wake it up
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int idle = this->nWaiting.load();
+    // more functors than idle workers, the autoscaler may have to grow the pool
+    if (n > idle && this->parked.load(std::memory_order_relaxed))
+        this->wake_scaler();
+    if (idle == 0)
+        return;
+    std::unique_lock<std::mutex> lock(this->mutex);
+    auto count = this->perNode.size();
+    if (count == 1)
+    {
+        auto &cv = this->perNode[0]->cv;
+        if (n >= idle)
+            cv.notify_all();
+        else
+            for (int i = 0; i < n; ++i)
+                cv.notify_one();
+        return;
+    }
+    auto first = static_cast<std::size_t>(std::max(node, 0));
+    for (std::size_t k = 0; k < count; ++k)
+    {
+        auto &workers = *this->perNode[(first + k) % count];
+        int waiters = workers.idle.load();
+        if (n >= waiters)
+            workers.cv.notify_all();
+        else
+            for (int i = 0; i < n; ++i)
+                workers.cv.notify_one();
+        if (node >= 0)
+        {
+            // the other nodes share the functors the node can't take right away
+            if (k > 0)
+                others -= waiters;
+            n = others;
+        }
+        if (n <= 0)
+            break;
+    }
+}
+
+int tp::thread_pool::spill(int node, std::size_t queued)
+{
+    if (this->perNode.size() == 1)
+        return 0;
+    auto &workers = *this->perNode[static_cast<std::size_t>(node)];
+    // the same conditions as next_task takes them from another node under
+    auto keep = static_cast<std::size_t>(std::max(workers.idle.load(), 0));
+    return queued > keep ? static_cast<int>(queued - keep) : 0;
+}
+
+int tp::thread_pool::spill(int node)
+{
+    // as next_task steals from the deques of another node
+    return this->perNode.size() > 1 && this->perNode[static_cast<std::size_t>(node)]->idle == 0 ? 1 : 0;
+}
+
+void tp::thread_pool::notify_all()
+{
+    for (auto &node : this->perNode)
+        node->cv.notify_all();
+}
+
+bool tp::thread_pool::next_task(worker &self, detail::Task *&t)
+{
+    if (self.deque.pop(t))
+        return true;
+    auto n_nodes = this->queues.size();
+    auto own = static_cast<std::size_t>(self.node);
+    if (this->queues[own]->pop(t))
+        return true;
+
+    auto snapshot = std::atomic_load(&this->workers);
+    auto n = snapshot->size();
+    // start at a different victim each time so the thieves spread over the deques
+    static thread_local std::size_t next_victim = 0;
+    auto first = next_victim++;
+    if (n_nodes == 1)
+    {
+        for (std::size_t k = 0; k < n; ++k)
+        {
+            auto &victim = (*snapshot)[(first + k) % n];
+            if (victim.get() != &self && victim->deque.steal(t))
+                return true;
+        }
+        return false;
+    }
+    for (std::size_t k = 0; k < n; ++k)
+    {
+        auto &victim = (*snapshot)[(first + k) % n];
+        if (victim.get() != &self && victim->node == self.node && victim->deque.steal(t))
+            return true;
+    }
+    // the local node ran dry: better run remotely than late, the other nodes only keep one functor per idle worker
+    // for themselves, what their busy workers would leave waiting is taken
+    for (std::size_t k = 1; k < n_nodes; ++k)
+    {
+        auto i = (own + k) % n_nodes;
+        if (this->queues[i]->pop(t, false, static_cast<std::size_t>(std::max(this->perNode[i]->idle.load(), 0))))
+            return true;
+    }
+    for (std::size_t k = 0; k < n; ++k)
+    {
+        auto &victim = (*snapshot)[(first + k) % n];
+        if (victim->node != self.node && this->perNode[static_cast<std::size_t>(victim->node)]->idle == 0 && victim->deque.steal(t))
+            return true;
+    }
+    return false;
+}
+
+void tp::thread_pool::run(detail::Task *t, int id)
+{
+    local_task = t;
+    try
+    {
+        (*t)(id);
+    }
+    catch (...)
+    {
+        // nobody is there to receive it, push() reports exceptions through its future instead
+    }
+    local_task = nullptr;
+    this->done(t);
+    this->release(t);
+}
+
+void tp::thread_pool::done(detail::Task *t)
+{
+    detail::TenantLimit * limit = t->counted;
+    if (!limit)
+        return;
+    t->counted = nullptr;
+    --limit->running;
+    // a worker may have passed over the tenant at its cap and gone to sleep
+    if (limit->max_running.load(std::memory_order_relaxed) != 0)
+        this->notify(1);
+}
+
+void tp::thread_pool::retire(worker &self)
+{
+    detail::Task * _t;
+    while (self.deque.pop(_t))
+        this->queues[static_cast<std::size_t>(self.node)]->push(_t);
+    if (self.free)
+    {
+        detail::Task * last = self.free;
+        while (last->next)
+            last = last->next;
+        this->slab.release(self.free, last);
+        self.free = nullptr;
+        self.nFree = 0;
+    }
+    {
+        std::unique_lock<std::mutex> lock(this->mutex);
+        this->notify_all();
+    }
+    self.exited = true;
 }
 
 void tp::thread_pool::set_thread(int i)
 {
-    std::shared_ptr<std::atomic<bool>> flag(this->flags[i]); // a copy of the shared ptr to the flag
-    auto f = [this, i, flag/* a copy of the shared ptr to the flag */]()
+    std::shared_ptr<worker> w((*std::atomic_load(&this->workers))[i]); // a copy of the shared ptr to the worker
+    auto f = [this, i, w/* a copy of the shared ptr to the worker */]()
     {
-        std::atomic<bool> & _flag = *flag;
-        std::function<void(int id)> * _f;
-        bool isPop = this->q.pop(_f);
+        local_pool = this;
+        local_worker = w.get();
+        if (!w->cpus.empty())
+            pin_current_thread(w->cpus);
+        std::atomic<bool> & _flag = w->flag;
+        detail::Task * _t;
+        bool isPop = this->next_task(*w, _t);
         while (true)
         {
             while (isPop)  // if there is anything in the queue
             {
-                std::unique_ptr<std::function<void(int id)>> func(_f); // at return, delete the function even if an exception occurred
-                (*_f)(i);
+                this->run(_t, i);
                 if (_flag)
+                {
+                    this->retire(*w);
                     return;  // the thread is wanted to stop, return even if the queue is not empty yet
+                }
                 else
-                    isPop = this->q.pop(_f);
+                    isPop = this->next_task(*w, _t);
             }
             // the queue is empty here, wait for the next command
             std::unique_lock<std::mutex> lock(this->mutex);
+            auto &node = *this->perNode[static_cast<std::size_t>(w->node)];
             ++this->nWaiting;
-            this->cv.wait(lock, [this, &_f, &isPop, &_flag](){ isPop = this->q.pop(_f); return isPop || this->isDone || _flag; });
+            ++node.idle;
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            node.cv.wait(lock, [this, &w, &_t, &isPop, &_flag](){ isPop = this->next_task(*w, _t); return isPop || this->isDone || _flag; });
+            --node.idle;
             --this->nWaiting;
+            this->nWakeups.fetch_add(1, std::memory_order_relaxed);
             if (!isPop)
+            {
+                lock.unlock();
+                this->retire(*w);
                 return;  // if the queue is empty and this->isDone == true or *flag then return
+            }
         }
     };
     // this->threads[i].reset(new std::thread(f)); // if not support make_unique
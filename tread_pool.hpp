@@ -3,6 +3,7 @@
 
 
 #include <functional>
+#include <chrono>
 #include <thread>
 #include <atomic>
 #include <vector>
@@ -10,7 +11,12 @@
 #include <exception>
 #include <future>
 #include <mutex>
-#include <queue>
+#include <cstdint>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <iterator>
+#include <string>
 
 
 
@@ -18,50 +24,373 @@
 //      ret func(int id, other_params)
 // where id is the index of the thread that runs the functor
 // ret is some return type
+//
+// every worker owns a work-stealing deque, functors pushed from a worker go to its own deque,
+// functors pushed from other threads go to a shared injection queue
+// an idle worker takes from its own deque first, then from the injection queue, then steals from the others
+//
+// the injection queue is ordered by urgency: the higher priority first and within a priority the earliest deadline,
+// functors posted without one go to the back of the queue.
+// a functor gains one priority for every aging period it is overdue compared to the others, so none starves
+//
+// the injection queue is shared between tenants: each has its own queue in that order, and the tenants
+// with functors waiting take turns by deficit round robin, each taking up to its weight at a time.
+// a tenant can be capped to a number of functors running at once, it is passed over while it is at the cap
+//
+// the workers can be pinned to a set of cpus and spread over the NUMA nodes, see placement.
+// with per_node placement every node has its own injection queue, its workers take from it first
+// and steal from the workers of their node before going to other nodes
 
 
 namespace tp
 {
+    struct urgency
+    {
+        int priority = 0;
+        std::chrono::system_clock::time_point deadline;
+        int tenant = 0;  // from thread_pool::add_tenant
+        int node = -1;   // with per_node placement the node whose workers should run it, -1 for the node of the caller
+    };
+
+    // the cpus of each NUMA node, as root lists them in node*/cpulist.
+    // one node with all online cpus where that is not available
+    std::vector<std::vector<int>> numa_nodes(const std::string &root = "/sys/devices/system/node");
+
+    // a list like "0-3,8,10-11" as in cpulist files, throws std::invalid_argument
+    std::vector<int> parse_cpu_list(const std::string &list);
+
+    // best effort, false if the thread could not be pinned
+    bool pin_current_thread(const std::vector<int> &cpus);
+
+    // where the workers of a pool run
+    struct placement
+    {
+        std::vector<int> cpus;  // the workers are kept on these cpus, on all of them if empty
+        // a group of workers per NUMA node with cpus among those, pinned to the cpus of their node
+        bool per_node = false;
+        std::vector<std::vector<int>> nodes;  // the topology, numa_nodes() if empty
+        // no worker runs there, it is kept for the thread that feeds the pool, like the scheduler's dispatcher
+        int reserved_cpu = -1;
+    };
+
+    struct tenant_stats
+    {
+        unsigned int weight;
+        unsigned int max_running;
+        std::size_t queued;
+        unsigned int running;  // only counted for tenants other than 0 or with a cap
+        std::uint64_t started;
+        // the time in the injection queue of the functors posted with an urgency
+        std::chrono::nanoseconds mean_wait;
+        std::chrono::nanoseconds max_wait;
+    };
+
     namespace detail
     {
-        template <typename T>
-        class Queue
+        struct TenantLimit;
+
+        // move-only type-erased functor with signature void(int id)
+        // functors up to inline_size bytes are stored in place, bigger ones on the heap
+        // the objects are recycled by the pool, so submitting a small functor does not allocate
+        class Task
+        {
+
+        public:
+            static constexpr std::size_t inline_size = 48;
+
+            Task() = default;
+            Task(const Task &) = delete;
+            Task& operator=(const Task &) = delete;
+            ~Task() { this->reset(); }
+
+            template<typename F>
+            void assign(F && f);
+
+            void operator()(int id) { this->ops->invoke(this->storage, id); }
+
+            // destroys the stored functor
+            void reset();
+
+            Task * next = nullptr;  // link in the queue or free list the task is in
+
+            // order in the injection queue, the lowest rank first and the same ranks in the order they came
+            static constexpr std::int64_t unranked = INT64_MIN;
+            std::int64_t rank = unranked;
+            std::uint64_t sequence = 0;
+
+            int tenant = 0;
+            int node = -1;              // urgency::node
+            std::int64_t posted = 0;    // steady_clock ticks for the wait statistics, 0 if not measured
+            std::int64_t taken = 0;     // when it left the injection queue, 0 if not measured
+            TenantLimit * counted = nullptr; // the tenant whose running count the task is in while it runs
+
+        private:
+            struct Ops
+            {
+                void (*invoke)(void *storage, int id);
+                void (*destroy)(void *storage);
+            };
+
+            template<typename F>
+            struct InlineOps
+            {
+                static void invoke(void *storage, int id) { (*static_cast<F *>(storage))(id); }
+                static void destroy(void *storage) { static_cast<F *>(storage)->~F(); }
+                static constexpr Ops ops{invoke, destroy};
+            };
+
+            template<typename F>
+            struct HeapOps
+            {
+                static void invoke(void *storage, int id) { (**static_cast<F **>(storage))(id); }
+                static void destroy(void *storage) { delete *static_cast<F **>(storage); }
+                static constexpr Ops ops{invoke, destroy};
+            };
+
+            const Ops * ops = nullptr;
+            alignas(std::max_align_t) unsigned char storage[inline_size];
+        };
+
+        template<typename F>
+        void Task::assign(F &&f)
+        {
+            using Functor = typename std::decay<F>::type;
+            this->reset();
+            if (sizeof(Functor) <= inline_size && alignof(Functor) <= alignof(std::max_align_t))
+            {
+                new (this->storage) Functor(std::forward<F>(f));
+                this->ops = &InlineOps<Functor>::ops;
+            }
+            else
+            {
+                *reinterpret_cast<Functor **>(this->storage) = new Functor(std::forward<F>(f));
+                this->ops = &HeapOps<Functor>::ops;
+            }
+        }
+
+        template<typename F>
+        constexpr Task::Ops Task::InlineOps<F>::ops;
+
+        template<typename F>
+        constexpr Task::Ops Task::HeapOps<F>::ops;
+
+        // tasks by Task::rank, FIFO among the same ranks, not synchronized
+        // most tasks come in rank order, they are appended to a list linked through Task::next,
+        // the ones that come out of order go to a binary heap. the heap only grows, so a warmed up queue does not allocate
+        class RankedQueue
         {
 
         public:
-            bool push(T const & value);
-            bool pop(T & v);  // deletes the retrieved element, do not use for non integral types
+            void push(Task * t);
+            bool pop(Task *& t);
+            bool empty() const { return !this->head && this->heap.empty(); }
+            std::size_t size() const { return this->n; }
+
+        private:
+            // the keys are copied next to the pointer, so sifting does not touch the tasks
+            struct Entry
+            {
+                std::int64_t rank;
+                std::uint64_t sequence;
+                Task * task;
+            };
+
+            // a is taken after b
+            static bool after(const Entry & a, const Entry & b);
+
+            Task * head = nullptr;
+            Task * tail = nullptr;
+            std::vector<Entry> heap;
+            std::int64_t back = Task::unranked;  // the highest rank queued since the queue was last empty
+            std::uint64_t pushed = 0;
+            std::size_t n = 0;
+        };
+
+        // the cap of a tenant, shared by its queues on every node
+        struct TenantLimit
+        {
+            std::atomic<unsigned int> max_running{0};  // 0 for no cap
+            std::atomic<unsigned int> running{0};
+        };
+
+        struct Tenant
+        {
+            // under the mutex of the queue
+            unsigned int weight = 1;
+            RankedQueue queue;
+            unsigned int deficit = 0;      // tasks it may still take in its current turn
+            bool active = false;           // in the round, that is it has tasks queued
+            std::uint64_t started = 0;
+
+            std::shared_ptr<TenantLimit> limit;
+            std::atomic<std::uint64_t> timed{0};
+            std::atomic<std::int64_t> total_wait{0};
+            std::atomic<std::int64_t> max_wait{0};
+        };
+
+        // the injection queue, a RankedQueue per tenant served by deficit round robin
+        // on a cache line of its own, the queues of different nodes are not to share one
+        class alignas(64) TaskQueue
+        {
+
+        public:
+            explicit TaskQueue(std::shared_ptr<TenantLimit> limit);  // of tenant 0
+
+            // the number of tasks queued after them
+            std::size_t push(Task * t);
+            // a list linked through Task::next
+            std::size_t push(Task * first, Task * last);
+            // passes over the tenants at their cap unless ignore_caps, for emptying the queue.
+            // leaves keep tasks in the queue, for the workers of its own node when taken from another node
+            bool pop(Task *& t, bool ignore_caps = false, std::size_t keep = 0);
             bool empty();
 
+            int add_tenant(unsigned int weight, std::shared_ptr<TenantLimit> limit);
+            void set_weight(int tenant, unsigned int weight);
+            std::vector<tenant_stats> stats();
+            // tasks queued now and taken so far
+            void counts(std::size_t & queued, std::uint64_t & taken);
+
+        private:
+            // tenant 0 takes the tasks without one, the tenants are never removed
+            std::vector<std::unique_ptr<Tenant>> tenants;
+            // the active tenants in the order of their turns, the one at turn goes next
+            std::vector<Tenant *> round;
+            std::size_t turn = 0;
+            std::size_t queued = 0;
+            std::uint64_t taken = 0;
+            std::mutex mutex;
+        };
+
+        // owns every Task of a pool, tasks are allocated in blocks and never freed before the pool is destroyed
+        class TaskSlab
+        {
+
+        public:
+            Task * acquire();
+            // n tasks linked through Task::next, the last one's next is nullptr
+            Task * acquire(int n);
+            // gives back a list of reset tasks linked through Task::next
+            void release(Task * first, Task * last);
+
         private:
-            std::queue<T> q;
+            static constexpr int block_size = 64;
+
+            Task * free = nullptr;
+            std::vector<std::unique_ptr<Task[]>> blocks;
             std::mutex mutex;
         };
 
+        // Chase-Lev work-stealing deque, as in "Correct and Efficient Work-Stealing for Weak Memory Models"
+        // (Le, Pop, Cohen, Zappa Nardelli, PPoPP 2013)
+        // push and pop may only be called by the owning thread, steal may be called by any thread
+        // T has to be trivially copyable, the pool stores pointers
+        template <typename T>
+        class WorkStealingDeque
+        {
+
+        public:
+            explicit WorkStealingDeque(std::int64_t capacity = 256);
+            WorkStealingDeque(const WorkStealingDeque &) = delete;
+            WorkStealingDeque& operator=(const WorkStealingDeque &) = delete;
+
+            void push(T v);
+            bool pop(T & v);
+            bool steal(T & v);
+            bool empty() const;
+
+        private:
+            struct Array
+            {
+                explicit Array(std::int64_t capacity) : capacity(capacity), buffer(new std::atomic<T>[capacity]) {}
+
+                T get(std::int64_t i) const { return buffer[i & (capacity - 1)].load(std::memory_order_relaxed); }
+                void put(std::int64_t i, T v) { buffer[i & (capacity - 1)].store(v, std::memory_order_relaxed); }
+
+                std::int64_t capacity;  // always a power of 2
+                std::unique_ptr<std::atomic<T>[]> buffer;
+            };
+
+            Array * grow(Array * a, std::int64_t bottom, std::int64_t top);
+
+            std::atomic<std::int64_t> top;
+            std::atomic<std::int64_t> bottom;
+            std::atomic<Array *> array;
+            // arrays replaced by grow, thieves may still read from them so they live as long as the deque
+            std::vector<std::unique_ptr<Array>> arrays;
+        };
+
         template<typename T>
-        bool Queue<T>::push(const T &value)
+        WorkStealingDeque<T>::WorkStealingDeque(std::int64_t capacity) : top(0), bottom(0)
         {
-            std::unique_lock<std::mutex> lock(this->mutex);
-            this->q.push(value);
-            return true;
+            this->arrays.emplace_back(new Array(capacity));
+            this->array.store(this->arrays.back().get(), std::memory_order_relaxed);
         }
 
         template<typename T>
-        bool Queue<T>::pop(T &v)
+        void WorkStealingDeque<T>::push(T v)
         {
-            std::unique_lock<std::mutex> lock(this->mutex);
-            if (this->q.empty())
+            std::int64_t b = this->bottom.load(std::memory_order_relaxed);
+            std::int64_t t = this->top.load(std::memory_order_acquire);
+            Array * a = this->array.load(std::memory_order_relaxed);
+            if (b - t > a->capacity - 1)
+                a = this->grow(a, b, t);
+            a->put(b, v);
+            std::atomic_thread_fence(std::memory_order_release);
+            this->bottom.store(b + 1, std::memory_order_relaxed);
+        }
+
+        template<typename T>
+        bool WorkStealingDeque<T>::pop(T &v)
+        {
+            std::int64_t b = this->bottom.load(std::memory_order_relaxed) - 1;
+            Array * a = this->array.load(std::memory_order_relaxed);
+            this->bottom.store(b, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            std::int64_t t = this->top.load(std::memory_order_relaxed);
+            if (t > b)
+            {  // the deque was empty
+                this->bottom.store(b + 1, std::memory_order_relaxed);
                 return false;
-            v = this->q.front();
-            this->q.pop();
+            }
+            v = a->get(b);
+            if (t == b)
+            {  // the last element, race the thieves for it
+                bool won = this->top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+                this->bottom.store(b + 1, std::memory_order_relaxed);
+                return won;
+            }
             return true;
         }
 
         template<typename T>
-        bool Queue<T>::empty()
+        bool WorkStealingDeque<T>::steal(T &v)
+        {
+            std::int64_t t = this->top.load(std::memory_order_acquire);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            std::int64_t b = this->bottom.load(std::memory_order_acquire);
+            if (t >= b)
+                return false;
+            Array * a = this->array.load(std::memory_order_acquire);
+            v = a->get(t);
+            return this->top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+        }
+
+        template<typename T>
+        bool WorkStealingDeque<T>::empty() const
         {
-            std::unique_lock<std::mutex> lock(this->mutex);
-            return this->q.empty();
+            return this->bottom.load(std::memory_order_relaxed) <= this->top.load(std::memory_order_relaxed);
+        }
+
+        template<typename T>
+        typename WorkStealingDeque<T>::Array * WorkStealingDeque<T>::grow(Array *a, std::int64_t bottom, std::int64_t top)
+        {
+            this->arrays.emplace_back(new Array(a->capacity * 2));
+            Array * bigger = this->arrays.back().get();
+            for (std::int64_t i = top; i < bottom; ++i)
+                bigger->put(i, a->get(i));
+            this->array.store(bigger, std::memory_order_release);
+            return bigger;
         }
     }
 
@@ -72,16 +401,45 @@ namespace tp
 
         thread_pool();
         explicit thread_pool(int nThreads);
+        thread_pool(int nThreads, const placement & where);
         ~thread_pool();       // the destructor waits for all the functions in the queue to be finished
         int size();           // get the number of running threads in the pool
         int n_idle();         // number of idle threads
+        std::size_t n_queued();  // functors waiting in the injection queues, not counting the ones in the workers' deques
+        std::uint64_t n_wakeups();  // times an idle thread woke up, for work or to stop
         std::thread & get_thread(int i);
 
-        // change the number of threads in the pool
-        // should be called from one thread, otherwise be careful to not interleave, also with this->stop()
+        // change the number of threads in the pool, may be called from any thread at any time
+        // the threads taken away finish the functor they are running first, they are joined once they are done
         // nThreads must be >= 0
         void resize(int nThreads);
 
+        // sizes the pool between min_threads and max_threads from then on: it grows while functors wait in the injection
+        // queue longer than wait and idle workers are retired once they were idle all through cooldown.
+        // max_threads 0 stops autoscaling. should be called from one thread
+        void autoscale(int min_threads, int max_threads,
+                       std::chrono::milliseconds wait = std::chrono::milliseconds(50),
+                       std::chrono::milliseconds cooldown = std::chrono::seconds(10));
+
+        // how long overdue a functor has to be to go before one of the next higher priority, 1 second by default
+        void set_aging(std::chrono::system_clock::duration aging);
+
+        // a share of the injection queue, for posting with an urgency. weight is how many functors it takes in its turn,
+        // at most max_running of them run at once, 0 for no cap.
+        // tenant 0 takes the functors posted without one, it has weight 1 and no cap until set_tenant changes that
+        int add_tenant(unsigned int weight = 1, unsigned int max_running = 0);
+        void set_tenant(int tenant, unsigned int weight, unsigned int max_running = 0);
+        // by tenant
+        std::vector<tenant_stats> tenants();
+
+        // when the functor running on the calling thread was posted and taken from the injection queue, read from the
+        // clock the pool reads for its wait statistics anyway. false for functors posted without an urgency,
+        // taken from a deque or outside of the pool's threads
+        static bool current_times(std::chrono::steady_clock::time_point & posted, std::chrono::steady_clock::time_point & taken);
+
+        // the NUMA nodes the workers are spread over, 1 without per_node placement
+        int nodes() const;
+
         // empty the queue
         void clear_queue();
 
@@ -102,10 +460,7 @@ namespace tp
                     (
                             std::bind(std::forward<F>(f), std::placeholders::_1, std::forward<Rest>(rest)...)
                     );
-            auto _f = new std::function<void(int id)>([pck](int id) { (*pck)(id); });
-            this->q.push(_f);
-            std::unique_lock<std::mutex> lock(this->mutex);
-            this->cv.notify_one();
+            this->post([pck](int id) { (*pck)(id); });
             return pck->get_future();
         }
         // run the user's function that excepts argument int - id of the running thread. returned value is templatized
@@ -114,32 +469,194 @@ namespace tp
         auto push(F && f) -> std::future<decltype(f(0))>
         {
             auto pck = std::make_shared<std::packaged_task<decltype(f(0))(int)>>(std::forward<F>(f));
-            auto _f = new std::function<void(int id)>([pck](int id){ (*pck)(id); });
-            this->q.push(_f);
-            std::unique_lock<std::mutex> lock(this->mutex);
-            this->cv.notify_one();
+            this->post([pck](int id){ (*pck)(id); });
             return pck->get_future();
         }
+        // run the user's function that excepts argument int - id of the running thread, without a way to get a result
+        // the functor is stored in a recycled detail::Task, no allocation happens if it fits in Task::inline_size
+        // exceptions thrown by the functor are dropped
+        template<typename F>
+        void post(F && f)
+        {
+            detail::Task * t = this->acquire();
+            t->assign(std::forward<F>(f));
+            t->rank = detail::Task::unranked;
+            t->tenant = 0;
+            t->node = -1;
+            t->posted = 0;
+            this->enqueue(t);
+        }
+        template<typename F>
+        void post(F && f, urgency u)
+        {
+            detail::Task * t = this->acquire();
+            t->assign(std::forward<F>(f));
+            t->rank = this->rank_of(u);
+            t->tenant = u.tenant;
+            t->node = u.node;
+            t->posted = std::chrono::steady_clock::now().time_since_epoch().count();
+            this->enqueue(t);
+        }
+        // post every functor in [first, last), they are moved out of the range
+        // the whole batch is queued under one lock and at most one idle worker per functor is woken up
+        template<typename It>
+        void post_batch(It first, It last)
+        {
+            this->post_batch(first, last, nullptr);
+        }
+        // same, urgency_of tells the urgency of each functor before it is moved out
+        template<typename It, typename U>
+        void post_batch(It first, It last, U && urgency_of)
+        {
+            auto n = static_cast<int>(std::distance(first, last));
+            if (n == 0)
+                return;
+            detail::Task * head = this->acquire(n);
+            detail::Task * tail = head;
+            std::int64_t posted = std::is_same<typename std::decay<U>::type, std::nullptr_t>::value
+                                  ? 0 : std::chrono::steady_clock::now().time_since_epoch().count();
+            for (detail::Task * t = head; first != last; ++first, t = t->next)
+            {
+                this->place(t, urgency_of, *first);
+                t->posted = posted;
+                t->assign(std::move(*first));
+                tail = t;
+            }
+            this->enqueue(head, tail, n);
+        }
 
 
 
     private:
 
+        struct worker
+        {
+            std::atomic<bool> flag{false};  // the thread is wanted to stop
+            std::atomic<bool> exited{false};  // it stopped, joining it does not block
+            int node = 0;
+            std::vector<int> cpus;  // pinned to, none if empty
+            detail::WorkStealingDeque<detail::Task *> deque;
+            // tasks released by this worker, handed back to the slab in batches
+            detail::Task * free = nullptr;
+            int nFree = 0;
+        };
+        using worker_list = std::vector<std::shared_ptr<worker>>;
+
+        static constexpr int max_free_per_worker = 128;
+
+        // an empty task, from the current worker's free list if possible
+        detail::Task * acquire();
+        // n empty tasks linked through Task::next
+        detail::Task * acquire(int n);
+        // destroys the functor and recycles the task
+        void release(detail::Task * t);
+
+        // to the local deque when called from one of this pool's workers, to the injection queue otherwise
+        void enqueue(detail::Task * t);
+        // a list of n tasks linked through Task::next
+        void enqueue(detail::Task * first, detail::Task * last, int n);
+
+        // wakes up to n idle workers of node and up to others of the other nodes, up to n on every node for -1
+        void notify(int n, int node = -1, int others = 0);
+        // how many of the queued functors of node the workers of other nodes may take
+        int spill(int node, std::size_t queued);
+        // 1 if the other nodes may steal from the deques of its workers
+        int spill(int node);
+        // with mutex locked
+        void notify_all();
+
+        // the deadline moved ahead by one aging period per priority
+        std::int64_t rank_of(urgency u) const;
+        // sets the rank, tenant and node of t from the urgency of v, without one it goes to the back of tenant 0
+        template<typename U, typename V>
+        void place(detail::Task * t, U & urgency_of, const V & v) const
+        {
+            urgency u = urgency_of(v);
+            t->rank = this->rank_of(u);
+            t->tenant = u.tenant;
+            t->node = u.node;
+        }
+        template<typename V>
+        void place(detail::Task * t, std::nullptr_t, const V &) const
+        {
+            t->rank = detail::Task::unranked;
+            t->tenant = 0;
+            t->node = -1;
+        }
+
+        // a task taken from the injection queue is done or dropped, after it was run or handed out by pop()
+        void done(detail::Task * t);
+
+        // own deque, then the injection queue of its node, then the deques of the workers of its node,
+        // then what the workers of the other nodes can't take right away from their queues and deques
+        bool next_task(worker & self, detail::Task *& t);
+        // the index of the node's injection queue, the node of the calling thread for -1
+        std::size_t queue_of(int node);
+        // summed over the injection queues
+        void counts(std::size_t & queued, std::uint64_t & taken);
+
+        // runs the task and recycles it
+        void run(detail::Task * t, int id);
+
+        // hands the functors left in the deque of a stopping worker over to the others
+        void retire(worker & self);
+
         void set_thread(int i);
+        // joins the threads taken away by resize that have exited, with resizing locked
+        void reap();
+
+        // the autoscaling controller, on its own thread
+        void scale(int min_threads, int max_threads, std::chrono::milliseconds wait, std::chrono::milliseconds cooldown);
+        void stop_scaling();
+        void wake_scaler();
 
         std::vector<std::unique_ptr<std::thread>> threads;
-        std::vector<std::shared_ptr<std::atomic<bool>>> flags;
-        detail::Queue<std::function<void(int id)> *> q;
+        // replaced as a whole on resize, thieves work on the snapshot they loaded
+        std::shared_ptr<const worker_list> workers;
+        // threads taken away by resize and not joined yet
+        std::vector<std::pair<std::unique_ptr<std::thread>, std::shared_ptr<worker>>> retired;
+        std::atomic<int> nWorkers;
+        std::mutex resizing;  // for threads, workers and retired
+
+        std::thread scaler;
+        std::mutex scaleMutex;
+        std::condition_variable scaleCv;
+        bool scaleStop = false;
+        // the controller waits for work instead of looking every period, notify wakes it
+        std::atomic<bool> parked{false};
+        detail::TaskSlab slab;
+        // one injection queue per node, the tenants have the same ids in each
+        std::vector<std::unique_ptr<detail::TaskQueue>> queues;
+        std::vector<std::shared_ptr<detail::TenantLimit>> limits;  // by tenant
+        std::mutex tenantsMutex;  // for limits and adding tenants to every queue
+        // the cpus of each node the workers go to, with the placement applied, one empty list for no pinning
+        std::vector<std::vector<int>> nodeCpus;
+        std::vector<int> nodeOfCpu;  // by cpu, for urgency::node -1
         std::atomic<bool> isDone;
         std::atomic<bool> isStop;
         std::atomic<int> nWaiting;  // how many threads are waiting
+        std::atomic<std::uint64_t> nWakeups{0};
+        // the workers of a node, the idle ones wait on its cv. on a cache line of its own like the queues
+        struct alignas(64) node_workers
+        {
+            std::condition_variable cv;
+            std::atomic<int> n{0};
+            std::atomic<int> idle{0};
+        };
+        std::vector<std::unique_ptr<node_workers>> perNode;
+        std::atomic<std::int64_t> aging;  // in system_clock ticks
 
         std::mutex mutex;
-        std::condition_variable cv;
+
+        // the pool and worker the current thread belongs to, if any
+        static thread_local thread_pool * local_pool;
+        static thread_local worker * local_worker;
+        // the task running on the current thread
+        static thread_local detail::Task * local_task;
     };
 
 }
 
 
 
-#endif
\ No newline at end of file
+#endif